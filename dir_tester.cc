@@ -0,0 +1,176 @@
+/* dir tester.
+ * Test the on-disk hash table directories of yfs_client: lookups and
+ * readdir across the rewrites that double the buckets, reuse of freed
+ * records, and reads of what is not a file.
+ */
+
+#include "yfs_client.h"
+#include <stdio.h>
+#include <map>
+#include <list>
+
+#define ROOT 1
+
+#define iprint(msg) \
+    printf("[TEST_ERROR]: %s\n", msg);
+yfs_client *yfs;
+
+std::string name_of(const char *prefix, int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s%03d", prefix, i);
+    return buf;
+}
+
+unsigned long long dir_size(yfs_client::inum dir)
+{
+    struct stat st;
+    if (yfs->getstat(dir, st) != yfs_client::OK)
+        return 0;
+    return st.st_size;
+}
+
+// the entries of dir are those of model, and each is found by lookup
+bool same_entries(yfs_client::inum dir,
+                  std::map<std::string, yfs_client::inum> &model)
+{
+    std::list<yfs_client::dirent> l;
+    if (yfs->readdir(dir, l) != yfs_client::OK || l.size() != model.size())
+        return false;
+    std::map<std::string, yfs_client::inum> got;
+    std::list<yfs_client::dirent>::iterator it;
+    for (it = l.begin(); it != l.end(); ++it)
+        got[it->name] = it->inum;
+    if (got != model)
+        return false;
+    std::map<std::string, yfs_client::inum>::iterator m;
+    for (m = model.begin(); m != model.end(); ++m) {
+        bool found;
+        yfs_client::inum ino;
+        if (yfs->lookup(dir, m->first.c_str(), found, ino) != yfs_client::OK ||
+            !found || ino != m->second)
+            return false;
+    }
+    return true;
+}
+
+int test_many_entries()
+{
+    yfs_client::inum dir, ino;
+    std::map<std::string, yfs_client::inum> model;
+
+    printf("begin test many entries\n");
+    yfs->mkdir(ROOT, "many", 0777, dir);
+    // enough for the buckets to double several times
+    for (int i = 0; i < 1000; i++) {
+        std::string name = name_of("f", i);
+        if (yfs->create(dir, name.c_str(), 0666, ino) != yfs_client::OK) {
+            iprint("error create, return not OK");
+            return 1;
+        }
+        model[name] = ino;
+    }
+    if (yfs->create(dir, "f500", 0666, ino) != yfs_client::EXIST) {
+        iprint("error create, an entry made twice");
+        return 2;
+    }
+    if (!same_entries(dir, model)) {
+        iprint("error readdir or lookup after the directory grew");
+        return 3;
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        std::string name = name_of("f", i);
+        if (yfs->unlink(dir, name.c_str()) != yfs_client::OK) {
+            iprint("error unlink, return not OK");
+            return 4;
+        }
+        model.erase(name);
+    }
+    if (!same_entries(dir, model)) {
+        iprint("error readdir or lookup after unlink");
+        return 5;
+    }
+    printf("end test many entries\n");
+    return 0;
+}
+
+int test_free_records()
+{
+    yfs_client::inum dir, fresh, ino;
+    std::map<std::string, yfs_client::inum> model;
+
+    printf("begin test free records\n");
+    yfs->mkdir(ROOT, "churn", 0777, dir);
+    for (int i = 0; i < 40; i++) {
+        yfs->create(dir, name_of("a", i).c_str(), 0666, ino);
+        model[name_of("a", i)] = ino;
+    }
+    for (int i = 0; i < 20; i++) {
+        yfs->unlink(dir, name_of("a", i).c_str());
+        model.erase(name_of("a", i));
+    }
+    // names of the same length take the records just freed
+    unsigned long long size = dir_size(dir);
+    for (int i = 0; i < 20; i++) {
+        yfs->create(dir, name_of("b", i).c_str(), 0666, ino);
+        model[name_of("b", i)] = ino;
+    }
+    if (dir_size(dir) != size || !same_entries(dir, model)) {
+        iprint("error create, freed records not reused");
+        return 1;
+    }
+
+    // when the buckets double, the directory is rewritten without its
+    // free records: as big as one that never had them
+    for (int i = 20; i < 40; i++) {
+        yfs->unlink(dir, name_of("b", i - 20).c_str());
+        model.erase(name_of("b", i - 20));
+    }
+    for (int i = 0; i < 60; i++) {
+        yfs->create(dir, name_of("c", i).c_str(), 0666, ino);
+        model[name_of("c", i)] = ino;
+    }
+    yfs->mkdir(ROOT, "fresh", 0777, fresh);
+    std::map<std::string, yfs_client::inum>::iterator m;
+    for (m = model.begin(); m != model.end(); ++m)
+        yfs->create(fresh, m->first.c_str(), 0666, ino);
+    if (!same_entries(dir, model) || dir_size(dir) != dir_size(fresh)) {
+        iprint("error create, free records kept by the rewrite");
+        return 2;
+    }
+    printf("end test free records\n");
+    return 0;
+}
+
+int test_read_not_file()
+{
+    yfs_client::inum dir;
+    std::string data = "stale";
+
+    printf("begin test read of a directory\n");
+    yfs->mkdir(ROOT, "notfile", 0777, dir);
+    if (yfs->read(dir, 10, 0, data) == yfs_client::OK || data != "") {
+        iprint("error read, a directory read as a file");
+        return 1;
+    }
+    printf("end test read of a directory\n");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 1) {
+        printf("Usage: ./dir_tester\n");
+        return 1;
+    }
+
+    yfs = new yfs_client();
+    int failed = 0;
+    failed += test_many_entries() != 0;
+    failed += test_free_records() != 0;
+    failed += test_read_not_file() != 0;
+
+    printf("---------------------------------\n");
+    printf("dir tests failed : %d\n", failed);
+    return failed != 0;
+}
@@ -1,58 +1,934 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "ylog.h"
+#include "slock.h"
 #include <sstream>
 #include <iostream>
+#include <set>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <time.h>
+#include <algorithm>
+
+// The cache keeps the attributes and the whole contents of recently used
+// extents, least recently used first out, within YFS_CACHE bytes. put
+// and write_range on an extent whose contents and attributes are cached
+// only change the cache, as long as it has room for them; the extent is
+// written back by flush(), when it is evicted, or at exit(). Only the
+// byte ranges written since are sent, with write_range, unless a put
+// replaced the contents. Writes the cache has no room for go to the
+// server at once, so that its NOSPC reaches the caller. A compound
+// updates the cached copies of the extents it changes. Reads served
+// from the cache do not move the server's atime.
+//
+// A write-back the server refuses (NOSPC, say) loses the changes: the
+// cached copy is dropped, and the next read sees what the server kept.
+// The error is returned by the flush() that did the write-back or, if
+// an eviction did, held for the next flush(), put or write_range of the
+// extent, like the error of a failed write-back of dirty pages is for
+// fsync(2).
+//
+// Nothing keeps the caches of clients sharing an extent server
+// coherent, so the cache is off by default when the server is remote.
+#define CACHE_DEFAULT    (32 << 20)   // YFS_CACHE default with a local server
+#define CACHE_FETCH_MAX  (256 << 10)  // read_range fetches extents up to this whole
+#define CACHE_ENTRY_COST 128          // bytes charged per entry besides its data
+#define CACHE_RANGES     64           // dirty ranges per extent before it is written back whole
 
 extent_client::extent_client()
+  : cl(NULL), checksum(false)
 {
   es = new extent_server();
+  cache_init(CACHE_DEFAULT);
+}
+
+// dst is the "host:port" of the extent server
+extent_client::extent_client(std::string dst)
+  : es(NULL)
+{
+  char *env = getenv("YFS_CHECKSUM");
+  checksum = env && atoi(env);
+  cache_init(0);
+
+  sockaddr_in dstsock;
+  make_sockaddr(dst.c_str(), &dstsock);
+  cl = new rpcc(dstsock);
+  if (cl->bind() != 0)
+    ylog(JSL_DBG_2, "extent_client: bind failed\n");
+}
+
+static pthread_mutex_t clients_m = PTHREAD_MUTEX_INITIALIZER;
+
+// Every client with a cache, written back at exit(). Never destroyed.
+static std::vector<extent_client *> &
+clients()
+{
+  static std::vector<extent_client *> *v = new std::vector<extent_client *>;
+  return *v;
+}
+
+static void
+flush_clients()
+{
+  ScopedLock cl(&clients_m);
+  for (unsigned int i = 0; i < clients().size(); i++)
+    clients()[i]->flush();
+}
+
+void
+extent_client::cache_init(long dflt)
+{
+  char *env = getenv("YFS_CACHE");
+  budget = env ? atol(env) : dflt;
+  used = 0;
+  hits = misses = writebacks = evictions = 0;
+  for (int i = 0; i < NLOCKS; i++)
+    VERIFY(pthread_mutex_init(&locks[i], NULL) == 0);
+  VERIFY(pthread_mutex_init(&cache_m, NULL) == 0);
+
+  if (budget == 0)
+    return;
+  ScopedLock cl(&clients_m);
+  if (clients().empty())
+    atexit(flush_clients);
+  clients().push_back(this);
+}
+
+// Hand the reply of an in-process get or read_range to the caller.
+static extent_protocol::status
+fetch(int ret, const rpc_buf &b, std::string &buf)
+{
+  if (b.len > 0)
+    buf.assign(b.data, b.len);
+  else
+    buf.clear();
+  return ret;
+}
+
+// What read_range of [off, off + n) returns from an extent holding data.
+static void
+slice(const std::string &data, unsigned int off, unsigned int n,
+      std::string &buf)
+{
+  if (off >= data.size())
+    buf.clear();
+  else
+    buf.assign(data, off, n);
 }
 
+// Check the data of a get or read_range over RPC.
 extent_protocol::status
-extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
+extent_client::recv(int ret, const rpc_string &r)
+{
+  if (ret == extent_protocol::OK && r.corrupt) {
+    ylog(JSL_DBG_2, "extent_client: checksum mismatch, %u bytes\n",
+         (unsigned int)r.s.size());
+    return extent_protocol::IOERR;
+  }
+  return ret;
+}
+
+// Cache --------------------------------------------------------------
+
+pthread_mutex_t *
+extent_client::elock(extent_protocol::extentid_t eid)
+{
+  return &locks[eid % NLOCKS];
+}
+
+// The entry of eid, made the most recently used; NULL if none. Holds
+// cache_m.
+extent_client::centry *
+extent_client::lookup(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, centry *>::iterator it =
+    cache.find(eid);
+  if (it == cache.end())
+    return NULL;
+  lru.splice(lru.begin(), lru, it->second->lru);
+  return it->second;
+}
+
+// The entry of eid, made empty if new. Holds cache_m.
+extent_client::centry *
+extent_client::insert(extent_protocol::extentid_t eid)
+{
+  centry *e = lookup(eid);
+  if (e)
+    return e;
+  e = new centry();
+  e->has_attr = e->has_data = e->dirty = e->whole = false;
+  lru.push_front(eid);
+  e->lru = lru.begin();
+  cache[eid] = e;
+  used += CACHE_ENTRY_COST;
+  return e;
+}
+
+// Holds cache_m. Contents go in and out of the cache by copy, never
+// sharing a (copy-on-write) string buffer with the caller's.
+void
+extent_client::set_data(centry *e, const std::string &buf)
+{
+  used += (long)buf.size() - (long)e->data.size();
+  e->data.assign(buf.data(), buf.size());
+  e->has_data = true;
+}
+
+// Write buf at off into the data of e, as the server does: zeros fill
+// any hole past the old end. Holds cache_m.
+void
+extent_client::apply(centry *e, unsigned int off, const std::string &buf)
+{
+  if (off + buf.size() > e->data.size()) {
+    used += off + buf.size() - e->data.size();
+    e->data.resize(off + buf.size(), '\0');
+  }
+  e->data.replace(off, buf.size(), buf);
+  e->a.size = e->data.size();
+  e->a.mtime = e->a.ctime = time(0);
+}
+
+// Note [off, end) of the data of e as newer than the server's, merged
+// with the ranges it overlaps or touches. Holds cache_m.
+void
+extent_client::mark(centry *e, unsigned int off, unsigned int end)
+{
+  e->dirty = true;
+  if (e->whole)
+    return;
+  std::map<unsigned int, unsigned int>::iterator it = e->ranges.upper_bound(off);
+  if (it != e->ranges.begin()) {
+    std::map<unsigned int, unsigned int>::iterator prev = it;
+    --prev;
+    if (prev->second >= off) {
+      off = prev->first;
+      end = std::max(end, prev->second);
+      e->ranges.erase(prev);
+    }
+  }
+  while (it != e->ranges.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    e->ranges.erase(it++);
+  }
+  e->ranges[off] = end;
+  if (e->ranges.size() > CACHE_RANGES) {
+    e->whole = true;
+    e->ranges.clear();
+  }
+}
+
+// Forget eid, changes included. Holds cache_m.
+void
+extent_client::drop(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, centry *>::iterator it =
+    cache.find(eid);
+  if (it == cache.end())
+    return;
+  centry *e = it->second;
+  used -= CACHE_ENTRY_COST + e->data.size();
+  lru.erase(e->lru);
+  cache.erase(it);
+  delete e;
+}
+
+// Evict the least recently used extents other than eid, writing back
+// their changes, until grow more bytes fit in the budget; false if they
+// do not. A failed write-back is held for take_error(). Holds cache_m
+// and the lock of eid. The lock of another extent is only tried, an
+// extent busy in another thread is passed over.
+bool
+extent_client::evict(extent_protocol::extentid_t eid, long grow)
+{
+  while (used + grow > budget) {
+    std::list<extent_protocol::extentid_t>::reverse_iterator it;
+    pthread_mutex_t *l = NULL;
+    for (it = lru.rbegin(); it != lru.rend(); ++it) {
+      if (*it == eid)
+        continue;
+      l = elock(*it);
+      if (l == elock(eid)) {
+        l = NULL;
+        break;
+      }
+      if (pthread_mutex_trylock(l) == 0)
+        break;
+    }
+    if (it == lru.rend())
+      return false;
+
+    extent_protocol::extentid_t v = *it;
+    centry *e = cache[v];
+    extent_protocol::status ret = extent_protocol::OK;
+    if (e->dirty) {
+      VERIFY(pthread_mutex_unlock(&cache_m) == 0);
+      ret = writeback(v, e);
+      VERIFY(pthread_mutex_lock(&cache_m) == 0);
+    }
+    if (ret != extent_protocol::OK)
+      errors[v] = ret;
+    drop(v);
+    evictions++;
+    if (l)
+      VERIFY(pthread_mutex_unlock(l) == 0);
+  }
+  return true;
+}
+
+// Evict extents until the cache is within its budget; eid goes last.
+// Holds cache_m and the lock of eid.
+void
+extent_client::shrink(extent_protocol::extentid_t eid)
 {
+  if (evict(eid, 0) || cache.find(eid) == cache.end())
+    return;
+
+  // eid alone is over the budget
+  centry *e = cache[eid];
   extent_protocol::status ret = extent_protocol::OK;
-  ret = es->create(type, id);
+  if (e->dirty) {
+    VERIFY(pthread_mutex_unlock(&cache_m) == 0);
+    ret = writeback(eid, e);
+    VERIFY(pthread_mutex_lock(&cache_m) == 0);
+  }
+  if (ret != extent_protocol::OK)
+    errors[eid] = ret;
+  drop(eid);
+  evictions++;
+}
+
+// The held write-back error of eid, now reported; OK if none. Holds
+// cache_m.
+extent_protocol::status
+extent_client::take_error(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, extent_protocol::status>::iterator it =
+    errors.find(eid);
+  if (it == errors.end())
+    return extent_protocol::OK;
+  extent_protocol::status ret = it->second;
+  errors.erase(it);
   return ret;
 }
 
+// Write the changes of a dirty entry to the server: its dirty ranges,
+// several in one compound, or its whole contents. If that fails the
+// entry is dropped, e with it. Holds the lock of eid, not cache_m.
 extent_protocol::status
-extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
+extent_client::writeback(extent_protocol::extentid_t eid, centry *e)
+{
+  extent_protocol::status ret;
+  std::map<unsigned int, unsigned int>::iterator it = e->ranges.begin();
+  if (e->whole) {
+    ret = srv_put(eid, e->data);
+  } else if (e->ranges.size() == 1) {
+    ret = srv_write_range(eid, it->first,
+                          e->data.substr(it->first, it->second - it->first));
+  } else {
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::result> res;
+    for (; it != e->ranges.end(); ++it) {
+      extent_protocol::op o;
+      o.type = extent_protocol::write_range;
+      o.id = eid;
+      o.off = it->first;
+      o.n = 0;
+      o.data.assign(e->data, it->first, it->second - it->first);
+      ops.push_back(o);
+    }
+    ret = srv_compound(ops, res);
+  }
+  ScopedLock ml(&cache_m);
+  if (ret != extent_protocol::OK) {
+    ylog(JSL_DBG_2, "extent_client: write back of %llu failed: %d\n",
+         eid, ret);
+    drop(eid);
+    return ret;
+  }
+  e->dirty = e->whole = false;
+  e->ranges.clear();
+  writebacks++;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid)
+{
+  if (budget == 0)
+    return extent_protocol::OK;
+  ScopedLock el(elock(eid));
+  centry *e;
+  {
+    ScopedLock ml(&cache_m);
+    extent_protocol::status ret = take_error(eid);
+    e = lookup(eid);
+    if (ret != extent_protocol::OK || !e || !e->dirty)
+      return ret;
+  }
+  return writeback(eid, e);
+}
+
+extent_protocol::status
+extent_client::flush()
 {
+  std::vector<extent_protocol::extentid_t> ids;
+  {
+    ScopedLock ml(&cache_m);
+    std::map<extent_protocol::extentid_t, centry *>::iterator it;
+    for (it = cache.begin(); it != cache.end(); ++it)
+      ids.push_back(it->first);
+    std::map<extent_protocol::extentid_t, extent_protocol::status>::iterator
+      er;
+    for (er = errors.begin(); er != errors.end(); ++er)
+      if (cache.find(er->first) == cache.end())
+        ids.push_back(er->first);
+  }
   extent_protocol::status ret = extent_protocol::OK;
-  ret = es->get(eid, buf);
+  for (unsigned int i = 0; i < ids.size(); i++) {
+    extent_protocol::status r = flush(ids[i]);
+    if (r != extent_protocol::OK)
+      ret = r;
+  }
   return ret;
 }
 
+std::string
+extent_client::cache_stats()
+{
+  ScopedLock ml(&cache_m);
+  char line[256];
+  snprintf(line, sizeof(line),
+           "extent cache hits %llu misses %llu writebacks %llu "
+           "evictions %llu bytes %ld of %ld\n",
+           hits, misses, writebacks, evictions, used, budget);
+  return line;
+}
+
+// Uncached calls -----------------------------------------------------
+
 extent_protocol::status
-extent_client::getattr(extent_protocol::extentid_t eid, 
-		       extent_protocol::attr &attr)
+extent_client::srv_get(extent_protocol::extentid_t eid, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  rpc_buf b;
+  if (cl) {
+    rpc_string r(buf);
+    ret = recv(cl->call(extent_protocol::get,
+                        checksum ? eid | extent_protocol::CHECKSUM : eid, r), r);
+  } else
+    ret = fetch(es->get(eid, b), b, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::srv_getattr(extent_protocol::extentid_t eid,
+		           extent_protocol::attr &attr)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (cl)
+    ret = cl->call(extent_protocol::getattr, eid, attr);
+  else
+    ret = es->getattr(eid, attr);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::srv_put(extent_protocol::extentid_t eid, const std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  if (cl)
+    ret = cl->call(extent_protocol::put, eid, rpc_bytes(buf, checksum), r);
+  else
+    ret = es->put(eid, rpc_bytes(buf), r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::srv_read_range(extent_protocol::extentid_t eid,
+                              unsigned int off, unsigned int n,
+                              std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = es->getattr(eid, attr);
+  rpc_buf b;
+  if (cl) {
+    rpc_string r(buf);
+    ret = recv(cl->call(extent_protocol::read_range,
+                        checksum ? eid | extent_protocol::CHECKSUM : eid,
+                        off, n, r), r);
+  } else
+    ret = fetch(es->read_range(eid, off, n, b), b, buf);
   return ret;
 }
 
 extent_protocol::status
-extent_client::put(extent_protocol::extentid_t eid, std::string buf)
+extent_client::srv_write_range(extent_protocol::extentid_t eid,
+                               unsigned int off, const std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = es->put(eid, buf, r);
+  if (cl)
+    ret = cl->call(extent_protocol::write_range, eid, off,
+                   rpc_bytes(buf, checksum), r);
+  else
+    ret = es->write_range(eid, off, rpc_bytes(buf), r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::srv_compound(const std::vector<extent_protocol::op> &ops,
+                            std::vector<extent_protocol::result> &res)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (cl && checksum)
+    ret = cl->call(extent_protocol::compound,
+                   extent_protocol::checked_ops(ops), res);
+  else if (cl)
+    ret = cl->call(extent_protocol::compound, ops, res);
+  else
+    ret = es->compound(ops, res);
+  // an op whose result came corrupt failed; the server stopped after
+  // the last one
+  for (size_t i = 0; ret == extent_protocol::OK && i < res.size(); i++)
+    ret = res[i].ret;
+  return ret;
+}
+
+// get (whole) or read_range, with getattr alongside.
+extent_protocol::status
+extent_client::srv_with_attr(extent_protocol::extentid_t eid, bool whole,
+                             unsigned int off, unsigned int n,
+                             std::string &buf, extent_protocol::attr &a)
+{
+  if (!cl) {
+    extent_protocol::status ret =
+      whole ? srv_get(eid, buf) : srv_read_range(eid, off, n, buf);
+    int aret = srv_getattr(eid, a);
+    return ret != extent_protocol::OK ? ret : aret;
+  }
+
+  rpc_future f;
+  cl->call_async(extent_protocol::getattr, eid, f);
+  extent_protocol::status ret =
+    whole ? srv_get(eid, buf) : srv_read_range(eid, off, n, buf);
+  int aret = f.get(a);
+  return ret != extent_protocol::OK ? ret : aret;
+}
+
+// Cached calls -------------------------------------------------------
+
+extent_protocol::status
+extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (cl)
+    ret = cl->call(extent_protocol::create, type, id);
+  else
+    ret = es->create(type, id);
+  if (ret != extent_protocol::OK || budget == 0)
+    return ret;
+
+  // a new extent is empty, nothing needs fetching
+  ScopedLock el(elock(id));
+  ScopedLock ml(&cache_m);
+  drop(id);
+  errors.erase(id);
+  centry *e = insert(id);
+  memset(&e->a, 0, sizeof(e->a));
+  e->a.type = type;
+  e->a.atime = e->a.mtime = e->a.ctime = time(0);
+  e->has_attr = true;
+  set_data(e, "");
+  shrink(id);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
+{
+  if (budget == 0)
+    return srv_get(eid, buf);
+  extent_protocol::attr a;
+  return get_with_attr(eid, buf, a);
+}
+
+extent_protocol::status
+extent_client::getattr(extent_protocol::extentid_t eid,
+		       extent_protocol::attr &attr)
+{
+  if (budget == 0)
+    return srv_getattr(eid, attr);
+
+  ScopedLock el(elock(eid));
+  {
+    ScopedLock ml(&cache_m);
+    centry *e = lookup(eid);
+    if (e && e->has_attr) {
+      hits++;
+      attr = e->a;
+      return extent_protocol::OK;
+    }
+    misses++;
+  }
+
+  extent_protocol::status ret = srv_getattr(eid, attr);
+  if (ret == extent_protocol::OK && attr.type != 0) {
+    ScopedLock ml(&cache_m);
+    centry *e = insert(eid);
+    e->a = attr;
+    e->has_attr = true;
+    shrink(eid);
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::put(extent_protocol::extentid_t eid, const std::string &buf)
+{
+  if (budget == 0)
+    return srv_put(eid, buf);
+
+  ScopedLock el(elock(eid));
+  bool cached;
+  {
+    ScopedLock ml(&cache_m);
+    extent_protocol::status ret = take_error(eid);
+    if (ret != extent_protocol::OK)
+      return ret;
+    centry *e = lookup(eid);
+    cached = e && e->has_attr;
+    if (cached && evict(eid, (long)buf.size() - (long)e->data.size())) {
+      set_data(e, buf);
+      e->a.size = buf.size();
+      e->a.mtime = e->a.ctime = time(0);
+      e->dirty = e->whole = true;
+      e->ranges.clear();
+      return extent_protocol::OK;
+    }
+  }
+
+  // without the attributes, which change, or without room, write through
+  extent_protocol::status ret = srv_put(eid, buf);
+  ScopedLock ml(&cache_m);
+  if (ret == extent_protocol::OK) {
+    // the server's copy is buf now, earlier changes included
+    centry *e = insert(eid);
+    set_data(e, buf);
+    if (cached) {
+      e->a.size = buf.size();
+      e->a.mtime = e->a.ctime = time(0);
+    }
+    e->dirty = e->whole = false;
+    e->ranges.clear();
+    shrink(eid);
+  } else {
+    centry *e = lookup(eid);
+    if (e && !e->dirty)
+      drop(eid);
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::read_range(extent_protocol::extentid_t eid, unsigned int off,
+                          unsigned int n, std::string &buf)
+{
+  if (budget == 0)
+    return srv_read_range(eid, off, n, buf);
+  extent_protocol::attr a;
+  return read_range_with_attr(eid, off, n, buf, a);
+}
+
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid, unsigned int off,
+                           const std::string &buf)
+{
+  if ((unsigned long long)off + buf.size() > extent_protocol::MAXSIZE)
+    return extent_protocol::FBIG;
+  if (budget == 0)
+    return srv_write_range(eid, off, buf);
+  if (buf.empty())
+    return extent_protocol::OK;
+
+  ScopedLock el(elock(eid));
+  bool cached;
+  {
+    ScopedLock ml(&cache_m);
+    extent_protocol::status ret = take_error(eid);
+    if (ret != extent_protocol::OK)
+      return ret;
+    centry *e = lookup(eid);
+    cached = e && e->has_data && e->has_attr;
+    if (cached) {
+      long grow = (long)off + buf.size() - (long)e->data.size();
+      if (evict(eid, std::max(grow, 0L))) {
+        apply(e, off, buf);
+        mark(e, off, off + buf.size());
+        return extent_protocol::OK;
+      }
+    }
+  }
+
+  // not cached, or without room: write through
+  extent_protocol::status ret = srv_write_range(eid, off, buf);
+  ScopedLock ml(&cache_m);
+  centry *e = lookup(eid);
+  if (ret == extent_protocol::OK && cached) {
+    apply(e, off, buf);
+    shrink(eid);
+  } else if (e && !e->dirty) {
+    drop(eid);
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::get_with_attr(extent_protocol::extentid_t eid, std::string &buf,
+                             extent_protocol::attr &a)
+{
+  if (budget == 0)
+    return srv_with_attr(eid, true, 0, 0, buf, a);
+
+  ScopedLock el(elock(eid));
+  {
+    ScopedLock ml(&cache_m);
+    centry *e = lookup(eid);
+    if (e && e->has_data && e->has_attr) {
+      hits++;
+      buf.assign(e->data.data(), e->data.size());
+      a = e->a;
+      return extent_protocol::OK;
+    }
+    misses++;
+  }
+
+  extent_protocol::status ret = srv_with_attr(eid, true, 0, 0, buf, a);
+  if (ret == extent_protocol::OK && a.type != 0) {
+    ScopedLock ml(&cache_m);
+    centry *e = insert(eid);
+    e->a = a;
+    e->has_attr = true;
+    set_data(e, buf);
+    shrink(eid);
+  }
+  return ret;
+}
+
+// A range of an extent not cached is fetched on its own, unless the
+// extent is known to be small; then it is fetched whole, and cached.
+extent_protocol::status
+extent_client::read_range_with_attr(extent_protocol::extentid_t eid,
+                                    unsigned int off, unsigned int n,
+                                    std::string &buf, extent_protocol::attr &a)
+{
+  if (budget == 0)
+    return srv_with_attr(eid, false, off, n, buf, a);
+
+  ScopedLock el(elock(eid));
+  bool whole = false;
+  {
+    ScopedLock ml(&cache_m);
+    centry *e = lookup(eid);
+    if (e && e->has_data && e->has_attr) {
+      hits++;
+      slice(e->data, off, n, buf);
+      a = e->a;
+      return extent_protocol::OK;
+    }
+    misses++;
+    if (e && e->has_attr) {
+      if (e->a.size > CACHE_FETCH_MAX) {
+        a = e->a;
+        return srv_read_range(eid, off, n, buf);
+      }
+      whole = true;
+    }
+  }
+
+  std::string data;
+  extent_protocol::status ret =
+    srv_with_attr(eid, whole, off, n, whole ? data : buf, a);
+  if (ret != extent_protocol::OK || a.type == 0)
+    return ret;
+  if (whole)
+    slice(data, off, n, buf);
+
+  ScopedLock ml(&cache_m);
+  centry *e = insert(eid);
+  e->a = a;
+  e->has_attr = true;
+  if (whole)
+    set_data(e, data);
+  shrink(eid);
   return ret;
 }
 
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
+  ScopedLock el(elock(eid));
+  {
+    ScopedLock ml(&cache_m);
+    drop(eid);
+    errors.erase(eid);
+  }
+
   extent_protocol::status ret = extent_protocol::OK;
   int r;
-  ret = es->remove(eid, r);
+  if (cl)
+    ret = cl->call(extent_protocol::remove, eid, r);
+  else
+    ret = es->remove(eid, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::statfs(extent_protocol::fsstat &st)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (cl)
+    ret = cl->call(extent_protocol::statfs, 0, st);
+  else
+    ret = es->statfs(0, st);
   return ret;
 }
 
+// The extents a compound touches are locked for its length, and their
+// changes written back before it; after it, their cached copies are
+// brought up to date with what it did.
+extent_protocol::status
+extent_client::compound(const std::vector<extent_protocol::op> &ops,
+                        std::vector<extent_protocol::result> &res)
+{
+  if (budget == 0)
+    return srv_compound(ops, res);
+
+  std::set<extent_protocol::extentid_t> ids;
+  std::set<pthread_mutex_t *> held;
+  for (unsigned int i = 0; i < ops.size(); i++) {
+    if (ops[i].id != 0) {
+      ids.insert(ops[i].id);
+      held.insert(elock(ops[i].id));
+    }
+  }
+  std::set<pthread_mutex_t *>::iterator l;
+  for (l = held.begin(); l != held.end(); ++l)
+    VERIFY(pthread_mutex_lock(*l) == 0);
+
+  extent_protocol::status ret = extent_protocol::OK;
+  std::set<extent_protocol::extentid_t>::iterator it;
+  for (it = ids.begin(); it != ids.end() && ret == extent_protocol::OK; ++it) {
+    centry *e;
+    {
+      ScopedLock ml(&cache_m);
+      e = lookup(*it);
+    }
+    if (e && e->dirty)
+      ret = writeback(*it, e);
+  }
+
+  if (ret == extent_protocol::OK) {
+    ret = srv_compound(ops, res);
+    ScopedLock ml(&cache_m);
+    if (ret != extent_protocol::OK && res.empty()) {
+      // the call itself failed, whatever the server did
+      for (it = ids.begin(); it != ids.end(); ++it)
+        drop(*it);
+    } else {
+      compound_done(ops, res);
+    }
+  }
 
+  for (l = held.begin(); l != held.end(); ++l)
+    VERIFY(pthread_mutex_unlock(*l) == 0);
+  return ret;
+}
+
+// Bring the cache up to date with the results of a compound. The ops
+// after a failed one did not run; the extent of the failed one is
+// forgotten, as it may have run in part. Holds cache_m and the locks of
+// the extents of ops, which are clean.
+void
+extent_client::compound_done(const std::vector<extent_protocol::op> &ops,
+                             const std::vector<extent_protocol::result> &res)
+{
+  extent_protocol::extentid_t created = 0, last = 0;
+  for (unsigned int i = 0; i < ops.size() && i < res.size(); i++) {
+    const extent_protocol::op &o = ops[i];
+    const extent_protocol::result &r = res[i];
+    extent_protocol::extentid_t id = o.id ? o.id : created;
+    if (r.ret != extent_protocol::OK) {
+      if (id != 0)
+        drop(id);
+      break;
+    }
+    centry *e = id != 0 ? lookup(id) : NULL;
+
+    switch (o.type) {
+    case extent_protocol::create:
+      // a new extent is empty, nothing needs fetching
+      id = created = r.id;
+      drop(id);
+      errors.erase(id);
+      e = insert(id);
+      memset(&e->a, 0, sizeof(e->a));
+      e->a.type = o.n;
+      e->a.atime = e->a.mtime = e->a.ctime = time(0);
+      e->has_attr = true;
+      set_data(e, "");
+      break;
+    case extent_protocol::getattr:
+      if (r.a.type != 0) {
+        e = insert(id);
+        e->a = r.a;
+        e->has_attr = true;
+      }
+      break;
+    case extent_protocol::get:
+      if (e && e->has_attr)
+        set_data(e, r.data);
+      break;
+    case extent_protocol::read_range:
+      break;
+    case extent_protocol::put:
+      if (e) {
+        set_data(e, o.data);
+        e->a.size = o.data.size();
+        e->a.mtime = e->a.ctime = time(0);
+      }
+      break;
+    case extent_protocol::write_range:
+      if (e && e->has_data) {
+        apply(e, o.off, o.data);
+      } else if (e) {
+        e->a.size = std::max(e->a.size, (unsigned int)(o.off + o.data.size()));
+        e->a.mtime = e->a.ctime = time(0);
+      }
+      break;
+    case extent_protocol::remove:
+      drop(id);
+      errors.erase(id);
+      break;
+    default:
+      drop(id);
+    }
+    if (o.id != 0 && cache.find(o.id) != cache.end())
+      last = o.id;
+  }
+  if (last != 0)
+    shrink(last);
+}
+
+extent_protocol::status
+extent_client::stats(std::string &s)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  if (cl)
+    ret = cl->call(extent_protocol::stats, 0, s);
+  else
+    ret = es->stats(0, s);
+  return ret;
+}
@@ -4,24 +4,132 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Talks to an extent_server in this process, or over RPC to a
+// standalone one (extent_server binary) if given its address.
+//
+// Attributes and contents are cached, see extent_client.cc. Writes to a
+// cached extent stay here until flush(), or until the extent is evicted;
+// then the byte ranges they changed are written back. If the server
+// refuses them, a later flush(), put or write_range of the extent says
+// so.
 class extent_client {
  private:
   extent_server *es;
+  rpcc *cl;
+  bool checksum;  // CRC32C on extent data over RPC, YFS_CHECKSUM set
+
+  // What is known of an extent. dirty means data (and a) are newer than
+  // the server's copy: in the ranges [off, end) of ranges, or throughout
+  // if whole.
+  struct centry {
+    extent_protocol::attr a;
+    bool has_attr;
+    std::string data;
+    bool has_data;
+    bool dirty;
+    bool whole;
+    std::map<unsigned int, unsigned int> ranges;  // off to end
+    std::list<extent_protocol::extentid_t>::iterator lru;
+  };
+
+  // An operation on an extent holds its lock, taken before cache_m, for
+  // its whole length; cache_m guards the cache and is never held over a
+  // call to the server. A compound holds the locks of all its extents,
+  // taken in address order; nothing else holds two.
+  enum { NLOCKS = 257 };
+  pthread_mutex_t locks[NLOCKS];
+  pthread_mutex_t cache_m;
+  std::map<extent_protocol::extentid_t, centry *> cache;
+  std::list<extent_protocol::extentid_t> lru;  // most recent first
+  // failed write-backs of evicted extents, not yet reported
+  std::map<extent_protocol::extentid_t, extent_protocol::status> errors;
+  long budget;  // bytes, 0 for no cache
+  long used;
+  unsigned long long hits, misses, writebacks, evictions;
+
+  void cache_init(long dflt);
+  pthread_mutex_t *elock(extent_protocol::extentid_t eid);
+  centry *lookup(extent_protocol::extentid_t eid);
+  centry *insert(extent_protocol::extentid_t eid);
+  void set_data(centry *e, const std::string &buf);
+  void apply(centry *e, unsigned int off, const std::string &buf);
+  void mark(centry *e, unsigned int off, unsigned int end);
+  void drop(extent_protocol::extentid_t eid);
+  bool evict(extent_protocol::extentid_t eid, long grow);
+  void shrink(extent_protocol::extentid_t eid);
+  extent_protocol::status take_error(extent_protocol::extentid_t eid);
+  void compound_done(const std::vector<extent_protocol::op> &ops,
+                     const std::vector<extent_protocol::result> &res);
+  extent_protocol::status writeback(extent_protocol::extentid_t eid,
+                                    centry *e);
+
+  // the calls themselves, uncached
+  extent_protocol::status srv_get(extent_protocol::extentid_t eid,
+                                  std::string &buf);
+  extent_protocol::status srv_getattr(extent_protocol::extentid_t eid,
+                                      extent_protocol::attr &a);
+  extent_protocol::status srv_put(extent_protocol::extentid_t eid,
+                                  const std::string &buf);
+  extent_protocol::status srv_read_range(extent_protocol::extentid_t eid,
+                                         unsigned int off, unsigned int n,
+                                         std::string &buf);
+  extent_protocol::status srv_write_range(extent_protocol::extentid_t eid,
+                                          unsigned int off,
+                                          const std::string &buf);
+  extent_protocol::status srv_compound(const std::vector<extent_protocol::op> &ops,
+                                       std::vector<extent_protocol::result> &res);
+  extent_protocol::status srv_with_attr(extent_protocol::extentid_t eid,
+                                        bool whole, unsigned int off,
+                                        unsigned int n, std::string &buf,
+                                        extent_protocol::attr &a);
+  extent_protocol::status recv(int ret, const rpc_string &r);
 
  public:
   extent_client();
+  extent_client(std::string dst);
 
   extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
-  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status put(extent_protocol::extentid_t eid,
+                              const std::string &buf);
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned int off, unsigned int n,
+                                     std::string &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      unsigned int off,
+                                      const std::string &buf);
+  // get (or read_range) together with getattr of the same extent; over
+  // RPC both are in flight at once, which costs one round trip not two
+  extent_protocol::status get_with_attr(extent_protocol::extentid_t eid,
+                                        std::string &buf,
+                                        extent_protocol::attr &a);
+  extent_protocol::status read_range_with_attr(extent_protocol::extentid_t eid,
+                                               unsigned int off, unsigned int n,
+                                               std::string &buf,
+                                               extent_protocol::attr &a);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status statfs(extent_protocol::fsstat &st);
+  // several calls in one message, see extent_server::compound
+  extent_protocol::status compound(const std::vector<extent_protocol::op> &ops,
+                                   std::vector<extent_protocol::result> &res);
+  // the RPC statistics of the extent server, as text
+  extent_protocol::status stats(std::string &s);
+
+  // write back the cached changes to eid, or to every extent
+  extent_protocol::status flush(extent_protocol::extentid_t eid);
+  extent_protocol::status flush();
+  // hits, misses, write-backs, evictions and bytes of the cache, as text
+  std::string cache_stats();
 };
 
 #endif 
-
@@ -9,14 +9,31 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  // NOSPC: the disk is full, or the extent is out of block map slots;
+  // FBIG: the extent would pass MAXSIZE
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, NOSPC, FBIG };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    read_range,
+    write_range,
+    statfs,
+    create,
+    compound,
+    stats
   };
 
+  // Set in the id of a get or read_range to have the data sent back
+  // with a CRC32C (see rpc_bytes); the server checks one on any data it
+  // is sent. In the id of a compound op it does both for the op.
+  static const extentid_t CHECKSUM = 1ULL << 62;
+
+  // Largest extent, in bytes. Sizes and offsets are 32 bits, and stay
+  // below this so that they round up to whole blocks without wrapping.
+  static const unsigned int MAXSIZE = 0xfffff000U;
+
   enum types {
     T_DIR = 1,
     T_FILE,
@@ -30,6 +47,40 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  struct fsstat {
+    uint32_t bsize;
+    uint32_t blocks;
+    uint32_t bfree;
+    uint32_t files;
+    uint32_t ffree;
+  };
+
+  // One step of a compound call, type is the rpc number of the single
+  // call it stands for. An id of 0 means the extent made by the last
+  // create before it in the same compound.
+  struct op {
+    uint32_t type;
+    extentid_t id;
+    unsigned int off;   // read_range, write_range
+    unsigned int n;     // read_range; the extent type for create
+    std::string data;   // put, write_range
+  };
+
+  struct result {
+    status ret;
+    extentid_t id;      // create
+    attr a;             // getattr
+    std::string data;   // get, read_range
+    bool crc;           // data sent with a CRC32C, not on the wire
+  };
+
+  // The ops of a compound, marshalled as a std::vector<op> with
+  // CHECKSUM set in every id.
+  struct checked_ops {
+    checked_ops(const std::vector<op> &o) : ops(o) {}
+    const std::vector<op> &ops;
+  };
 };
 
 inline unmarshall &
@@ -54,4 +105,91 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::fsstat &st)
+{
+  u >> st.bsize;
+  u >> st.blocks;
+  u >> st.bfree;
+  u >> st.files;
+  u >> st.ffree;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::fsstat st)
+{
+  m << st.bsize;
+  m << st.blocks;
+  m << st.bfree;
+  m << st.files;
+  m << st.ffree;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::op &o)
+{
+  u >> o.type;
+  u >> o.id;
+  u >> o.off;
+  u >> o.n;
+  rpc_string data(o.data);
+  u >> data;
+  if (data.corrupt)
+    u.set_bad();
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::op &o)
+{
+  m << o.type;
+  m << o.id;
+  m << o.off;
+  m << o.n;
+  m << rpc_bytes(o.data, (o.id & extent_protocol::CHECKSUM) != 0);
+  return m;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::checked_ops &c)
+{
+  m << (unsigned int)c.ops.size();
+  for (size_t i = 0; i < c.ops.size(); i++) {
+    const extent_protocol::op &o = c.ops[i];
+    m << o.type;
+    m << (o.id | extent_protocol::CHECKSUM);
+    m << o.off;
+    m << o.n;
+    m << rpc_bytes(o.data, true);
+  }
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::result &r)
+{
+  u >> r.ret;
+  u >> r.id;
+  u >> r.a;
+  // a corrupt result is an IOERR of its op, not a failed call
+  rpc_string data(r.data);
+  u >> data;
+  r.crc = false;
+  if (data.corrupt && r.ret == extent_protocol::OK)
+    r.ret = extent_protocol::IOERR;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::result &r)
+{
+  m << r.ret;
+  m << r.id;
+  m << r.a;
+  m << rpc_bytes(r.data, r.crc);
+  return m;
+}
+
 #endif 
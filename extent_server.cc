@@ -1,62 +1,131 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "ylog.h"
 #include <sstream>
+#include <set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "lang/verify.h"
+#include "rpc_stats.h"
+
+// Set while this thread runs a compound call, which holds the locks of
+// the extents it names for its whole length.
+static __thread bool in_compound;
+
+// Hold of the lock of an extent for the length of a single call.
+class extent_guard {
+ private:
+  pthread_mutex_t *l;
+ public:
+  extent_guard(pthread_mutex_t *lock) : l(in_compound ? NULL : lock) {
+    if (l)
+      VERIFY(pthread_mutex_lock(l) == 0);
+  }
+  ~extent_guard() {
+    if (l)
+      VERIFY(pthread_mutex_unlock(l) == 0);
+  }
+};
 
 extent_server::extent_server() 
 {
   im = new inode_manager();
+  for (int i = 0; i < INODE_NUM; i++)
+    VERIFY(pthread_mutex_init(&elocks[i], NULL) == 0);
+}
+
+pthread_mutex_t *
+extent_server::elock(extent_protocol::extentid_t id)
+{
+  return &elocks[(id & 0x7fffffff) % INODE_NUM];
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
-  printf("extent_server: create inode\n");
+  ylog(JSL_DBG_4, "extent_server: create inode\n");
   id = im->alloc_inode(type);
+  if (id == 0)
+    return extent_protocol::IOERR;
 
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::put(extent_protocol::extentid_t id, rpc_bytes buf, int &)
 {
+  extent_guard g(elock(id));
   id &= 0x7fffffff;
   
-  const char * cbuf = buf.c_str();
-  int size = buf.size();
-  im->write_file(id, cbuf, size);
+  int n = im->write_file(id, buf.data, buf.len);
+  if (n < 0)
+    return extent_protocol::NOENT;
+  if ((unsigned int)n < buf.len)
+    return extent_protocol::NOSPC;
   
   return extent_protocol::OK;
 }
 
-int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
+int extent_server::get(extent_protocol::extentid_t id, rpc_buf &buf)
 {
-  printf("extent_server: get %lld\n", id);
+  extent_guard g(elock(id));
+  ylog(JSL_DBG_4, "extent_server: get %lld\n", id);
 
+  buf.crc = (id & extent_protocol::CHECKSUM) != 0;
   id &= 0x7fffffff;
 
   int size = 0;
   char *cbuf = NULL;
 
   im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    buf = "";
-  else {
-    buf.assign(cbuf, size);
-    free(cbuf);
-  }
+  buf.data = cbuf;
+  buf.len = size;
+
+  return extent_protocol::OK;
+}
+
+int extent_server::read_range(extent_protocol::extentid_t id, unsigned int off,
+                              unsigned int n, rpc_buf &buf)
+{
+  extent_guard g(elock(id));
+  buf.crc = (id & extent_protocol::CHECKSUM) != 0;
+  id &= 0x7fffffff;
+
+  int size = 0;
+  char *cbuf = NULL;
+
+  im->read_range(id, off, n, &cbuf, &size);
+  buf.data = cbuf;
+  buf.len = size;
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write_range(extent_protocol::extentid_t id, unsigned int off,
+                               rpc_bytes buf, int &)
+{
+  extent_guard g(elock(id));
+  id &= 0x7fffffff;
+
+  if ((unsigned long long)off + buf.len > extent_protocol::MAXSIZE)
+    return extent_protocol::FBIG;
+  int n = im->write_range(id, off, buf.data, buf.len);
+  if (n < 0)
+    return extent_protocol::NOENT;
+  if ((unsigned int)n < buf.len)
+    return extent_protocol::NOSPC;
 
   return extent_protocol::OK;
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-  printf("extent_server: getattr %lld\n", id);
+  extent_guard g(elock(id));
+  ylog(JSL_DBG_4, "extent_server: getattr %lld\n", id);
 
   id &= 0x7fffffff;
   
@@ -70,7 +139,8 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
-  printf("extent_server: write %lld\n", id);
+  extent_guard g(elock(id));
+  ylog(JSL_DBG_4, "extent_server: write %lld\n", id);
 
   id &= 0x7fffffff;
   im->remove_file(id);
@@ -78,3 +148,93 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   return extent_protocol::OK;
 }
 
+int extent_server::statfs(int, extent_protocol::fsstat &st)
+{
+  ylog(JSL_DBG_4, "extent_server: statfs\n");
+
+  im->statfs(st);
+
+  return extent_protocol::OK;
+}
+
+
+int extent_server::compound(std::vector<extent_protocol::op> ops,
+                            std::vector<extent_protocol::result> &res)
+{
+  ylog(JSL_DBG_4, "extent_server: compound of %d\n", (int)ops.size());
+
+  // the extents named are locked in inode number order, so that
+  // compounds sharing some cannot deadlock; one a create makes is not,
+  // as nothing else knows of it yet
+  std::set<uint32_t> held;
+  for (size_t i = 0; i < ops.size(); i++)
+    if ((ops[i].id & ~extent_protocol::CHECKSUM) != 0)
+      held.insert(elock(ops[i].id) - elocks);
+  std::set<uint32_t>::iterator l;
+  for (l = held.begin(); l != held.end(); ++l)
+    VERIFY(pthread_mutex_lock(&elocks[*l]) == 0);
+  in_compound = true;
+
+  int ret = extent_protocol::OK;
+  extent_protocol::extentid_t created = 0;
+  res.clear();
+  for (size_t i = 0; i < ops.size() && ret == extent_protocol::OK; i++) {
+    const extent_protocol::op &o = ops[i];
+    extent_protocol::extentid_t id = o.id & ~extent_protocol::CHECKSUM;
+    if (id == 0)
+      id = created;
+    id |= o.id & extent_protocol::CHECKSUM;
+    extent_protocol::result r;
+    memset(&r.a, 0, sizeof(r.a));
+    r.id = 0;
+    r.crc = false;
+    int x;
+
+    switch (o.type) {
+    case extent_protocol::create:
+      r.ret = create(o.n, r.id);
+      created = r.id;
+      break;
+    case extent_protocol::getattr:
+      r.ret = getattr(id, r.a);
+      break;
+    case extent_protocol::get:
+    case extent_protocol::read_range: {
+      rpc_buf b;
+      if (o.type == extent_protocol::get)
+        r.ret = get(id, b);
+      else
+        r.ret = read_range(id, o.off, o.n, b);
+      if (b.len > 0)
+        r.data.assign(b.data, b.len);
+      r.crc = b.crc;
+      break;
+    }
+    case extent_protocol::put:
+      r.ret = put(id, rpc_bytes(o.data), x);
+      break;
+    case extent_protocol::write_range:
+      r.ret = write_range(id, o.off, rpc_bytes(o.data), x);
+      break;
+    case extent_protocol::remove:
+      r.ret = remove(id, x);
+      break;
+    default:
+      ylog(JSL_DBG_2, "extent_server: bad compound op %u\n", o.type);
+      r.ret = extent_protocol::RPCERR;
+    }
+    ret = r.ret;
+    res.push_back(r);
+  }
+
+  in_compound = false;
+  for (l = held.begin(); l != held.end(); ++l)
+    VERIFY(pthread_mutex_unlock(&elocks[*l]) == 0);
+  return ret;
+}
+
+int extent_server::stats(int, std::string &s)
+{
+  s = rpc_stats_dump();
+  return extent_protocol::OK;
+}
@@ -5,6 +5,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
@@ -18,15 +20,36 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // a call holds the lock of its extent, a compound those of the
+  // extents it names; by inode number
+  pthread_mutex_t elocks[INODE_NUM];
+  pthread_mutex_t *elock(extent_protocol::extentid_t id);
 
  public:
   extent_server();
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
-  int get(extent_protocol::extentid_t id, std::string &);
+  // Payloads are passed as rpc_bytes/rpc_buf so that they are not
+  // copied between the RPC layer and the inode layer.
+  int put(extent_protocol::extentid_t id, rpc_bytes, int &);
+  int get(extent_protocol::extentid_t id, rpc_buf &);
+  int read_range(extent_protocol::extentid_t id, unsigned int off,
+                 unsigned int n, rpc_buf &);
+  int write_range(extent_protocol::extentid_t id, unsigned int off,
+                  rpc_bytes, int &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int statfs(int, extent_protocol::fsstat &);
+  // Run ops in order, stopping at the first that fails; res gets the
+  // results of those that ran. No other call on the extents the ops
+  // name runs in between, but the compound is not atomic: the ops
+  // before a failed one stay done, and a failed put or write_range may
+  // have written part of its data. The caller undoes what it must,
+  // such as removing an extent it created.
+  int compound(std::vector<extent_protocol::op> ops,
+               std::vector<extent_protocol::result> &res);
+  // the RPC statistics of this process, as text
+  int stats(int, std::string &);
 };
 
 #endif 
@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "extent_server.h"
 
 // Main loop of extent server
@@ -23,6 +24,9 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  // Client connections are spread over RPC_POLL_THREADS reactor threads
+  // (rpc/pollmgr.h). Each is one fd, so thousands of clients need the
+  // open file limit (ulimit -n) raised to match.
   rpcs server(atoi(argv[1]), count);
   extent_server ls;
 
@@ -30,6 +34,25 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::statfs, &ls, &extent_server::statfs);
+  server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+  server.reg(extent_protocol::stats, &ls, &extent_server::stats);
+
+  // replies to reads may be dropped from the at-most-once window under
+  // memory pressure; the others change the store and are always kept
+  server.set_idempotent(extent_protocol::get);
+  server.set_idempotent(extent_protocol::getattr);
+  server.set_idempotent(extent_protocol::statfs);
+  server.set_idempotent(extent_protocol::read_range);
+  server.set_idempotent(extent_protocol::stats);
+
+  // RPC_STATS_INTERVAL=n prints the RPC statistics every n seconds
+  char *stats_env = getenv("RPC_STATS_INTERVAL");
+  if (stats_env != NULL)
+    rpc_stats_start_dumper(atoi(stats_env));
 
   while(1)
     sleep(1000);
@@ -17,14 +17,133 @@
 #include <arpa/inet.h>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "ylog.h"
+#include "slock.h"
+#include "rpc_stats.h"
+#include <deque>
 
 int myid;
 yfs_client *yfs;
 
+// How long the kernel may cache attributes and name lookups, in seconds.
+// Set with -o attr_timeout=N,entry_timeout=N; 0 means no caching.
+double attr_timeout = 0.0;
+double entry_timeout = 0.0;
+
+//
+// With caching on, a change made here has to be pushed to the kernel.
+// A notification must not be sent from the handler of a related
+// request, since the kernel may hold the very locks it needs until the
+// request is answered, so notifications are queued and sent by a
+// thread of their own.
+//
+struct inval {
+    fuse_ino_t ino;     // the inode, or the parent of the entry
+    std::string name;   // the entry to drop, empty to drop ino's attributes
+};
+
+static std::deque<inval> inval_queue;
+static pthread_mutex_t inval_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static struct fuse_chan *inval_chan;
+
+static void
+invalidate(fuse_ino_t ino, const char *name)
+{
+    if (inval_chan == NULL)
+        return;
+    inval iv;
+    iv.ino = ino;
+    if (name != NULL)
+        iv.name = name;
+    ScopedLock ml(&inval_mutex);
+    inval_queue.push_back(iv);
+    pthread_cond_signal(&inval_cond);
+}
+
+// Drop what the kernel knows of the attributes of ino.
+static void
+invalidate_inode(fuse_ino_t ino)
+{
+    invalidate(ino, NULL);
+}
+
+// Drop the kernel's lookup of name in parent, and parent's attributes.
+static void
+invalidate_entry(fuse_ino_t parent, const char *name)
+{
+    invalidate(parent, name);
+    invalidate(parent, NULL);
+}
+
+#if FUSE_VERSION >= 28
+static void *
+inval_thread(void *)
+{
+    while (1) {
+        inval iv;
+        {
+            ScopedLock ml(&inval_mutex);
+            while (inval_queue.empty())
+                pthread_cond_wait(&inval_cond, &inval_mutex);
+            iv = inval_queue.front();
+            inval_queue.pop_front();
+        }
+        // failures only mean the kernel had nothing cached
+        if (iv.name.empty())
+            fuse_lowlevel_notify_inval_inode(inval_chan, iv.ino, -1, 0);
+        else
+            fuse_lowlevel_notify_inval_entry(inval_chan, iv.ino,
+                    iv.name.data(), iv.name.size());
+    }
+    return NULL;
+}
+#endif
+
+// Parse the comma separated options of -o.
+static void
+parse_options(const char *opts)
+{
+    std::string all(opts);
+    std::string::size_type pos = 0;
+    while (pos <= all.size()) {
+        std::string::size_type end = all.find(',', pos);
+        if (end == std::string::npos)
+            end = all.size();
+        std::string opt = all.substr(pos, end - pos);
+        if (sscanf(opt.c_str(), "attr_timeout=%lf", &attr_timeout) != 1 &&
+            sscanf(opt.c_str(), "entry_timeout=%lf", &entry_timeout) != 1) {
+            fprintf(stderr, "yfs_client: unknown option %s\n", opt.c_str());
+            exit(1);
+        }
+        pos = end + 1;
+    }
+}
+
 int id() { 
     return myid;
 }
 
+// The errno for a yfs_client status, for handlers with no better one.
+static int
+errno_of(yfs_client::status r)
+{
+    switch (r) {
+    case yfs_client::OK:
+        return 0;
+    case yfs_client::NOENT:
+        return ENOENT;
+    case yfs_client::EXIST:
+        return EEXIST;
+    case yfs_client::NOSPC:
+        return ENOSPC;
+    case yfs_client::FBIG:
+        return EFBIG;
+    default:
+        return EIO;
+    }
+}
+
 //
 // A file/directory's attributes are a set of information
 // including owner, permissions, size, &c. The information is
@@ -40,48 +159,9 @@ int id() {
 yfs_client::status
 getattr(yfs_client::inum inum, struct stat &st)
 {
-    yfs_client::status ret;
-
-    bzero(&st, sizeof(st));
-
-    st.st_ino = inum;
-    printf("getattr %016llx %d\n", inum, yfs->isfile(inum));
-    if(yfs->isfile(inum)){
-        yfs_client::fileinfo info;
-        ret = yfs->getfile(inum, info);
-        if(ret != yfs_client::OK)
-            return ret;
-        st.st_mode = S_IFREG | 0666;
-        st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
-    } else if (yfs->isdir(inum)) {
-        yfs_client::dirinfo info;
-        ret = yfs->getdir(inum, info);
-        if(ret != yfs_client::OK)
-            return ret;
-        st.st_mode = S_IFDIR | 0777;
-        st.st_nlink = 2;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
-    } else if (yfs->issymlink(inum)) {
-        yfs_client::fileinfo info;
-        ret = yfs->getfile(inum, info);
-        if (ret != yfs_client::OK) return ret;
-        st.st_mode = S_IFLNK | 0777;
-        st.st_nlink = 1;
-        st.st_size = info.size;
-        st.st_atime = info.atime;
-        st.st_ctime = info.ctime;
-        st.st_mtime = info.mtime;
-        printf("   getattr -> symbolic link path length %llu\n", info.size);
-    }
-    return yfs_client::OK;
+    ylog(JSL_DBG_4, "getattr %016llx\n", inum);
+    // type, size and times all come back from a single extent getattr
+    return yfs->getstat(inum, st);
 }
 
 //
@@ -112,7 +192,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 }
 
 //
@@ -132,19 +212,24 @@ void
 fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         int to_set, struct fuse_file_info *fi)
 {
-    printf("fuseserver_setattr 0x%x\n", to_set);
+    ylog(JSL_DBG_4, "fuseserver_setattr 0x%x\n", to_set);
     if ((FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_SIZE) & to_set) {
-        printf("   fuseserver_setattr set size to %zu\n", attr->st_size);
+        ylog(JSL_DBG_4, "   fuseserver_setattr set size to %zu\n", attr->st_size);
         struct stat st;
 
 #if 1
         // Change the above line to "#if 1", and your code goes here
         // Note: fill st using getattr before fuse_reply_attr
         if (to_set & FUSE_SET_ATTR_SIZE) {
-            yfs->setattr(ino, attr->st_size);
+            int r = yfs->setattr(ino, attr->st_size);
+            invalidate_inode(ino);
+            if (r != yfs_client::OK) {
+                fuse_reply_err(req, errno_of(r));
+                return;
+            }
         }
         getattr(ino, st);
-        fuse_reply_attr(req, &st, 0);
+        fuse_reply_attr(req, &st, attr_timeout);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -211,6 +296,9 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
     int r;
     if ((r = yfs->write(ino, size, off, buf, size)) == yfs_client::OK) {
         fuse_reply_write(req, size);
+        invalidate_inode(ino);
+    } else if (r == yfs_client::NOSPC || r == yfs_client::FBIG) {
+        fuse_reply_err(req, errno_of(r));
     } else {
         fuse_reply_err(req, ENOENT);
     }
@@ -242,9 +330,9 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
+    // generations are always set to 0
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
     e->generation = 0;
 
     yfs_client::inum inum;
@@ -254,6 +342,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
 		ret = yfs->mkdir(parent, name, mode, inum);
     if (ret != yfs_client::OK)
         return ret;
+    invalidate_inode(parent);
     e->ino = inum;
     ret = getattr(inum, e->attr);
     return ret;
@@ -267,7 +356,7 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     yfs_client::status ret;
     if( (ret = fuseserver_createhelper( parent, name, mode, &e, extent_protocol::T_FILE)) == yfs_client::OK ) {
         fuse_reply_create(req, &e, fi);
-        printf("OK: create returns.\n");
+        ylog(JSL_DBG_4, "OK: create returns.\n");
     } else {
         if (ret == yfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
@@ -301,9 +390,9 @@ void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // generations are always set to 0
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
     e.generation = 0;
     bool found = false;
 
@@ -364,7 +453,7 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     yfs_client::inum inum = ino; // req->in.h.nodeid;
     struct dirbuf b;
 
-    printf("fuseserver_readdir\n");
+    ylog(JSL_DBG_4, "fuseserver_readdir\n");
 
     if(!yfs->isdir(inum)){
         fuse_reply_err(req, ENOTDIR);
@@ -391,6 +480,21 @@ fuseserver_open(fuse_req_t req, fuse_ino_t ino,
     fuse_reply_open(req, fi);
 }
 
+// close() and fsync() write back the changes the extent cache holds.
+void
+fuseserver_flush(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, errno_of(yfs->fsync(ino)));
+}
+
+void
+fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, errno_of(yfs->fsync(ino)));
+}
+
 //
 // Create a new directory with name @name in parent directory @parent.
 // Leave new directory's inum in e.ino and attributes in e.attr.
@@ -406,9 +510,9 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         mode_t mode)
 {
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    // generations are always set to 0
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
     e.generation = 0;
     // Suppress compiler warning of unused e.
     (void) e;
@@ -444,6 +548,7 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     int r;
     if ((r = yfs->unlink(parent, name)) == yfs_client::OK) {
         fuse_reply_err(req, 0);
+        invalidate_entry(parent, name);
     } else {
         if (r == yfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
@@ -457,14 +562,26 @@ void
 fuseserver_statfs(fuse_req_t req)
 {
     struct statvfs buf;
+    yfs_client::fsinfo info;
 
-    printf("statfs\n");
+    ylog(JSL_DBG_4, "statfs\n");
 
     memset(&buf, 0, sizeof(buf));
 
     buf.f_namemax = 255;
     buf.f_bsize = 512;
 
+    if (yfs->statfs(info) == yfs_client::OK) {
+        buf.f_bsize = info.bsize;
+        buf.f_frsize = info.bsize;
+        buf.f_blocks = info.blocks;
+        buf.f_bfree = info.bfree;
+        buf.f_bavail = info.bfree;
+        buf.f_files = info.files;
+        buf.f_ffree = info.ffree;
+        buf.f_favail = info.ffree;
+    }
+
     fuse_reply_statfs(req, &buf);
 }
 
@@ -476,10 +593,11 @@ void fuseserver_symlink(fuse_req_t req, const char *linkname, fuse_ino_t parent,
     (void) e;
     yfs_client::inum inum;
     if ((r = yfs->symlink(parent, linkname, 0, name, inum)) == yfs_client::OK) {
+        invalidate_inode(parent);
         struct fuse_entry_param e;
-        // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-        e.attr_timeout = 0.0;
-        e.entry_timeout = 0.0;
+        // generations are always set to 0
+        e.attr_timeout = attr_timeout;
+        e.entry_timeout = entry_timeout;
         e.generation = 0;
         e.ino = inum;
         getattr(inum, e.attr);
@@ -522,24 +640,45 @@ main(int argc, char *argv[])
 
     setvbuf(stdout, NULL, _IONBF, 0);
 
-#if 0
-    if(argc != 4){
-        fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
-        exit(1);
+    // yfs_client [-o ...] <mountpoint> [<port-extent-server> [<port-lock-server>]]
+    // Without an extent server port the extent server runs in this process.
+    const char *extent_port = 0, *lock_port = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            parse_options(argv[++i]);
+        else if (mountpoint == 0)
+            mountpoint = argv[i];
+        else if (extent_port == 0)
+            extent_port = argv[i];
+        else if (lock_port == 0)
+            lock_port = argv[i];
+        else {
+            mountpoint = 0;
+            break;
+        }
     }
-#endif
-    if(argc != 2){
-        fprintf(stderr, "Usage: yfs_client <mountpoint>\n");
+    if (mountpoint == 0) {
+        fprintf(stderr, "Usage: yfs_client "
+                "[-o attr_timeout=secs,entry_timeout=secs] <mountpoint> "
+                "[<port-extent-server> [<port-lock-server>]]\n");
         exit(1);
     }
-    mountpoint = argv[1];
 
     srandom(getpid());
 
     myid = random();
 
-    // yfs = new yfs_client(argv[2], argv[3]);
-    yfs = new yfs_client();
+    if (extent_port != 0) {
+        std::string extent_dst = std::string("127.0.0.1:") + extent_port;
+        yfs = new yfs_client(extent_dst, lock_port ? lock_port : "");
+        // RPC_STATS_INTERVAL=n prints this client's RPC statistics,
+        // retransmits among them, every n seconds
+        char *stats_env = getenv("RPC_STATS_INTERVAL");
+        if (stats_env != NULL)
+            rpc_stats_start_dumper(atoi(stats_env));
+    } else {
+        yfs = new yfs_client();
+    }
 
     fuseserver_oper.getattr    = fuseserver_getattr;
     fuseserver_oper.statfs     = fuseserver_statfs;
@@ -548,6 +687,8 @@ main(int argc, char *argv[])
     fuseserver_oper.create     = fuseserver_create;
     fuseserver_oper.mknod      = fuseserver_mknod;
     fuseserver_oper.open       = fuseserver_open;
+    fuseserver_oper.flush      = fuseserver_flush;
+    fuseserver_oper.fsync      = fuseserver_fsync;
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
     fuseserver_oper.setattr    = fuseserver_setattr;
@@ -611,9 +752,26 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
 
+    if (attr_timeout > 0 || entry_timeout > 0) {
+#if FUSE_VERSION >= 28
+        pthread_t th;
+        inval_chan = ch;
+        VERIFY(pthread_create(&th, NULL, inval_thread, NULL) == 0);
+#else
+        fprintf(stderr, "yfs_client: warning: this fuse cannot invalidate "
+                "the kernel caches, cached entries may be stale\n");
+#endif
+    }
+    // requests are served by a pool of threads, so that a slow request
+    // does not hold up the others; yfs_client and the layers below it
+    // lock per inode. YFS_SINGLE_THREADED serves one request at a time.
+    if (getenv("YFS_SINGLE_THREADED") != NULL)
+        err = fuse_session_loop(se);
+    else
+        err = fuse_session_loop_mt(se);
+
+    yfs->sync();
     fuse_session_destroy(se);
     close(fd);
     fuse_unmount(mountpoint);
@@ -1,28 +1,360 @@
 #include "inode_manager.h"
+#include "ylog.h"
+#include "slock.h"
+#include <climits>
 #include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // disk layer -----------------------------------------
 
-disk::disk()
+disk::disk(const char *path, uint32_t n)
+  : blocks(NULL), nblocks(n), fd(-1)
 {
-  bzero(blocks, sizeof(blocks));
+  void *p;
+
+  if (path != NULL) {
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      ylog(JSL_DBG_2, "\tdisk: error! cannot open image %s\n", path);
+      exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= BLOCK_SIZE) {
+      // an existing image keeps its own size
+      nblocks = st.st_size / BLOCK_SIZE;
+    } else if (ftruncate(fd, (off_t)nblocks * BLOCK_SIZE) != 0) {
+      ylog(JSL_DBG_2, "\tdisk: error! cannot resize image %s\n", path);
+      exit(1);
+    }
+    p = mmap(NULL, (size_t)nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  } else {
+    p = mmap(NULL, (size_t)nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (p == MAP_FAILED) {
+    ylog(JSL_DBG_2, "\tdisk: error! mmap %u blocks failed\n", nblocks);
+    exit(1);
+  }
+  blocks = (unsigned char *)p;
+}
+
+disk::~disk()
+{
+  sync();
+  munmap(blocks, (size_t)nblocks * BLOCK_SIZE);
+  if (fd >= 0)
+    close(fd);
 }
 
 void
 disk::read_block(blockid_t id, char *buf)
 {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
+  if (id >= nblocks) {
+    memset(buf, 0, BLOCK_SIZE);
+    return;
+  }
+  memcpy(buf, blocks + (size_t)id * BLOCK_SIZE, BLOCK_SIZE);
 }
 
 void
 disk::write_block(blockid_t id, const char *buf)
 {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
+  if (id >= nblocks)
+    return;
+  memcpy(blocks + (size_t)id * BLOCK_SIZE, buf, BLOCK_SIZE);
+}
+
+void
+disk::read_blocks(blockid_t id, uint32_t n, char *buf)
+{
+  if (id >= nblocks || n > nblocks - id) {
+    memset(buf, 0, (size_t)n * BLOCK_SIZE);
+    return;
+  }
+  memcpy(buf, blocks + (size_t)id * BLOCK_SIZE, (size_t)n * BLOCK_SIZE);
+}
+
+void
+disk::write_blocks(blockid_t id, uint32_t n, const char *buf)
+{
+  if (id >= nblocks || n > nblocks - id)
+    return;
+  memcpy(blocks + (size_t)id * BLOCK_SIZE, buf, (size_t)n * BLOCK_SIZE);
+}
+
+void
+disk::sync()
+{
+  if (fd < 0)
+    return;
+  msync(blocks, (size_t)nblocks * BLOCK_SIZE, MS_SYNC);
+  fsync(fd);
+}
+
+// block cache -----------------------------------------
+
+#define BCACHE_SIZE  (1 << 20)  // YFS_BCACHE default, bytes
+#define BCACHE_MIN   16         // buffers, whatever YFS_BCACHE says
+#define BCACHE_FLUSH 1          // YFS_BCACHE_FLUSH default, seconds
+
+static pthread_mutex_t all_caches_m = PTHREAD_MUTEX_INITIALIZER;
+
+// Every cache, for the flusher. Never destroyed, the flusher may still
+// run during exit().
+static std::vector<block_cache *> &
+caches()
+{
+  static std::vector<block_cache *> *v = new std::vector<block_cache *>;
+  return *v;
+}
+
+static void *
+bcache_flusher(void *arg)
+{
+  int secs = (int)(long)arg;
+  while (1) {
+    sleep(secs);
+    block_cache::flush_all();
+  }
+  return NULL;
+}
+
+block_cache::block_cache(disk *dd, uint32_t nbufs)
+  : d(dd), hand(0)
+{
+  VERIFY(pthread_mutex_init(&m, NULL) == 0);
+  if (nbufs < BCACHE_MIN)
+    nbufs = BCACHE_MIN;
+  for (uint32_t i = 0; i < nbufs; i++) {
+    buf *b = new buf();
+    b->valid = false;
+    b->ref = false;
+    b->pins = 0;
+    bufs.push_back(b);
+  }
+
+  ScopedLock al(&all_caches_m);
+  if (caches().empty()) {
+    char *env = getenv("YFS_BCACHE_FLUSH");
+    int secs = env ? atoi(env) : BCACHE_FLUSH;
+    pthread_t th;
+    if (secs > 0 && pthread_create(&th, NULL, bcache_flusher,
+                                   (void *)(long)secs) == 0)
+      pthread_detach(th);
+    atexit(flush_all);
+  }
+  caches().push_back(this);
+}
+
+// Write back a dirty buffer. Caller holds m.
+void
+block_cache::writeback(buf *b)
+{
+  d->write_block(b->id, b->data);
+  dirty.erase(b->id);
+}
+
+// A buffer to reuse, written back if dirty, out of the index. Caller
+// holds m. If every buffer is pinned there is one more.
+block_cache::buf *
+block_cache::victim()
+{
+  for (uint32_t n = 0; n < 2 * bufs.size(); n++) {
+    buf *b = bufs[hand];
+    hand = (hand + 1) % bufs.size();
+    if (b->pins > 0)
+      continue;
+    if (b->valid && b->ref) {
+      b->ref = false;
+      continue;
+    }
+    if (b->valid) {
+      if (dirty.count(b->id))
+        writeback(b);
+      index.erase(b->id);
+      b->valid = false;
+    }
+    return b;
+  }
+  ylog(JSL_DBG_3, "\tbc: all %u buffers pinned, adding one\n",
+       (unsigned int)bufs.size());
+  buf *b = new buf();
+  b->valid = false;
+  b->pins = 0;
+  bufs.push_back(b);
+  return b;
+}
+
+// The buffer of block id, read from disk if load. Caller holds m.
+block_cache::buf *
+block_cache::get(blockid_t id, bool load)
+{
+  std::map<blockid_t, buf *>::iterator it = index.find(id);
+  if (it != index.end()) {
+    it->second->ref = true;
+    return it->second;
+  }
+  buf *b = victim();
+  b->id = id;
+  b->valid = true;
+  b->ref = true;
+  if (load)
+    d->read_block(id, b->data);
+  index[id] = b;
+  return b;
+}
+
+void
+block_cache::read(blockid_t id, char *data)
+{
+  ScopedLock ml(&m);
+  memcpy(data, get(id, true)->data, BLOCK_SIZE);
+}
+
+void
+block_cache::write(blockid_t id, const char *data)
+{
+  ScopedLock ml(&m);
+  memcpy(get(id, false)->data, data, BLOCK_SIZE);
+  dirty.insert(id);
+}
+
+// Blocks changed in a buffer and not yet written back are copied over
+// what the disk has.
+void
+block_cache::read_blocks(blockid_t id, uint32_t n, char *data)
+{
+  ScopedLock ml(&m);
+  d->read_blocks(id, n, data);
+  std::set<blockid_t>::iterator it = dirty.lower_bound(id);
+  for (; it != dirty.end() && *it - id < n; ++it)
+    memcpy(data + (size_t)(*it - id) * BLOCK_SIZE, index[*it]->data,
+           BLOCK_SIZE);
+}
+
+// The buffers of the blocks written are updated, and clean.
+void
+block_cache::write_blocks(blockid_t id, uint32_t n, const char *data)
+{
+  ScopedLock ml(&m);
+  d->write_blocks(id, n, data);
+  std::map<blockid_t, buf *>::iterator it = index.lower_bound(id);
+  for (; it != index.end() && it->first - id < n; ++it) {
+    memcpy(it->second->data, data + (size_t)(it->first - id) * BLOCK_SIZE,
+           BLOCK_SIZE);
+    dirty.erase(it->first);
+  }
+}
+
+char *
+block_cache::pin(blockid_t id)
+{
+  ScopedLock ml(&m);
+  buf *b = get(id, true);
+  b->pins++;
+  return b->data;
+}
+
+void
+block_cache::unpin(blockid_t id, bool changed)
+{
+  ScopedLock ml(&m);
+  buf *b = index[id];
+  VERIFY(b != NULL && b->pins > 0);
+  b->pins--;
+  if (changed)
+    dirty.insert(id);
+}
+
+void
+block_cache::forget(blockid_t id, uint32_t n)
+{
+  ScopedLock ml(&m);
+  std::map<blockid_t, buf *>::iterator it = index.lower_bound(id);
+  while (it != index.end() && it->first - id < n) {
+    buf *b = it->second;
+    if (b->pins > 0) {
+      ++it;
+      continue;
+    }
+    dirty.erase(it->first);
+    b->valid = false;
+    index.erase(it++);
+  }
+}
+
+// From the highest block down, so that data blocks reach the disk
+// before the inode table and bitmaps that point at them. Pinned buffers
+// are being changed; they wait for the next flush. Caller holds m.
+void
+block_cache::flush_locked()
+{
+  std::set<blockid_t>::iterator it = dirty.end();
+  while (it != dirty.begin()) {
+    --it;
+    buf *b = index[*it];
+    if (b->pins > 0)
+      continue;
+    d->write_block(b->id, b->data);
+    dirty.erase(it++);
+  }
+}
+
+void
+block_cache::flush()
+{
+  ScopedLock ml(&m);
+  flush_locked();
+}
+
+void
+block_cache::flush_all()
+{
+  ScopedLock al(&all_caches_m);
+  for (unsigned int i = 0; i < caches().size(); i++)
+    caches()[i]->flush();
 }
 
 // block layer -----------------------------------------
 
+// Bitmap words per bitmap block
+#define WPB           (BPB / 64)
+
+// Mark block id used or free in the in-memory bitmap. The bitmap block
+// holding its bit is only written back by flush_bitmap().
+void
+block_manager::mark(uint32_t id, bool used)
+{
+  if (used)
+    bitmap[id / 64] |= 1ULL << (id % 64);
+  else
+    bitmap[id / 64] &= ~(1ULL << (id % 64));
+  bitmap_dirty[id / BPB] = true;
+}
+
+// Return the first free block in [from, to), 0 if there is none.
+// Scans a whole word of the bitmap at a time.
+blockid_t
+block_manager::find_free(uint32_t from, uint32_t to)
+{
+  for (uint32_t w = from / 64; w * 64 < to; w++) {
+    uint64_t word = bitmap[w];
+    if (w == from / 64)
+      word |= (1ULL << (from % 64)) - 1;
+    if (~word) {
+      uint32_t id = w * 64 + __builtin_ctzll(~word);
+      return id < to ? id : 0;
+    }
+  }
+  return 0;
+}
+
 // Allocate a free disk block.
+// Next-fit: the search starts where the previous one stopped.
 blockid_t
 block_manager::alloc_block()
 {
@@ -31,21 +363,100 @@ block_manager::alloc_block()
    * note: you should mark the corresponding bit in block bitmap when alloc.
    * you need to think about which block you can start to be allocated.
    */
+  ScopedLock ml(&alloc_mutex);
+  if (nfree == 0)
+    return 0;
 
-  int minDataBlkId = 1 + 8 + INODE_NUM / IPB;
-  for (int i = minDataBlkId + 1; i < BLOCK_NUM; i++) {
-    if (using_blocks.count(i) == 0 || using_blocks[i] == 0) {
-      using_blocks[i] = 1;
-      
-      // mark corresponding bit in bitmap as 1
-      char block_buf[BLOCK_SIZE];
-      read_block(BBLOCK(i), block_buf);
-      block_buf[i / 8] |= 1 << ( i % 8 );
-      write_block(BBLOCK(i), block_buf);
-      return i;
+  blockid_t id = find_free(cursor, sb.nblocks);
+  if (id == 0)
+    id = find_free(DBLOCK(sb.nblocks), cursor);
+  if (id == 0)
+    return 0;
+
+  mark(id, true);
+  nfree--;
+  cursor = id + 1 < sb.nblocks ? id + 1 : DBLOCK(sb.nblocks);
+  return id;
+}
+
+// Allocate up to n free disk blocks into ids.
+// Return the number of blocks allocated, less than n if the disk is full.
+uint32_t
+block_manager::alloc_blocks(uint32_t n, blockid_t *ids)
+{
+  ScopedLock ml(&alloc_mutex);
+  uint32_t got = 0;
+  uint32_t w = cursor / 64;
+  uint32_t nwords = (sb.nblocks + 63) / 64;
+
+  for (uint32_t scanned = 0; got < n && nfree > 0 && scanned <= nwords;
+       scanned++, w = (w + 1) % nwords) {
+    uint64_t freebits = ~bitmap[w];
+    while (freebits && got < n) {
+      blockid_t id = w * 64 + __builtin_ctzll(freebits);
+      freebits &= freebits - 1;
+      mark(id, true);
+      nfree--;
+      ids[got++] = id;
+      cursor = id + 1 < sb.nblocks ? id + 1 : DBLOCK(sb.nblocks);
     }
   }
-  return 0;
+  return got;
+}
+
+// Allocate a run of up to n contiguous free blocks into *start.
+// The run starts at goal if goal is free, so a file can grow in place,
+// otherwise at the next free block after the cursor.
+// Return the length of the run, 0 if the disk is full.
+uint32_t
+block_manager::alloc_extent(blockid_t goal, uint32_t n, blockid_t *start)
+{
+  ScopedLock ml(&alloc_mutex);
+  if (nfree == 0 || n == 0)
+    return 0;
+
+  blockid_t id = 0;
+  if (goal >= DBLOCK(sb.nblocks) && goal < sb.nblocks &&
+      !(bitmap[goal / 64] & (1ULL << (goal % 64))))
+    id = goal;
+  if (id == 0)
+    id = find_free(cursor, sb.nblocks);
+  if (id == 0)
+    id = find_free(DBLOCK(sb.nblocks), cursor);
+  if (id == 0)
+    return 0;
+
+  uint32_t len = 0;
+  while (len < n && id + len < sb.nblocks) {
+    blockid_t b = id + len;
+    if (b % 64 == 0 && n - len >= 64 && b + 64 <= sb.nblocks &&
+        bitmap[b / 64] == 0) {
+      bitmap[b / 64] = ~0ULL;
+      bitmap_dirty[b / BPB] = true;
+      len += 64;
+      continue;
+    }
+    if (bitmap[b / 64] & (1ULL << (b % 64)))
+      break;
+    mark(b, true);
+    len++;
+  }
+
+  nfree -= len;
+  cursor = id + len < sb.nblocks ? id + len : DBLOCK(sb.nblocks);
+  *start = id;
+  return len;
+}
+
+// The cached blocks are dropped while they are still ours, before
+// another thread can allocate and write them.
+void
+block_manager::free_extent(blockid_t start, uint32_t n)
+{
+  bc->forget(start, n);
+  ScopedLock ml(&alloc_mutex);
+  for (uint32_t i = 0; i < n; i++)
+    release(start + i);
 }
 
 void
@@ -55,74 +466,279 @@ block_manager::free_block(uint32_t id)
    * your code goes here.
    * note: you should unmark the corresponding bit in the block bitmap when free.
    */
-  using_blocks[id] = 0;
-  // mark bitmap
-  char bit_buf[BLOCK_SIZE];
-  read_block( BBLOCK(id), bit_buf );
-  uint32_t byte_offset = id / 8;
-  short bit_offset = id % 8;
-  bit_buf[byte_offset] = bit_buf[byte_offset] & (0xff ^ ( 1 << bit_offset));
-  d->write_block( BBLOCK(id), bit_buf);
+  bc->forget(id, 1);
+  ScopedLock ml(&alloc_mutex);
+  release(id);
+}
+
+// Mark block id free. Caller holds alloc_mutex.
+void
+block_manager::release(uint32_t id)
+{
+  if (id < DBLOCK(sb.nblocks) || id >= sb.nblocks) {
+    ylog(JSL_DBG_2, "\tbm: error! free block %u out of range\n", id);
+    return;
+  }
+  if (!(bitmap[id / 64] & (1ULL << (id % 64))))
+    return;
+  mark(id, false);
+  nfree++;
   return;
 }
 
+// Number of free data blocks.
+uint32_t
+block_manager::free_blocks()
+{
+  ScopedLock ml(&alloc_mutex);
+  return nfree;
+}
+
+// Write the dirty bitmap blocks back to disk.
+// The in-memory words have the same layout as the on-disk bitmap.
+void
+block_manager::flush_bitmap()
+{
+  ScopedLock ml(&alloc_mutex);
+  for (uint32_t i = 0; i < bitmap_dirty.size(); i++) {
+    if (!bitmap_dirty[i])
+      continue;
+    write_block(i + 2, (const char *)&bitmap[i * WPB]);
+    bitmap_dirty[i] = false;
+  }
+}
+
 // The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-// |1 blk | 4096 bytes -> 8 blk | 1024 / IPB    | 
+// |<-boot->|<-sb->|<-free block bitmap->|<-inode bitmap->|<-inode table->|<-data->|
+// | 1 blk  |1 blk | nblocks / BPB + 1   | IMBLOCKS       | 1024 / IPB    |
+//
+// The disk is backed by the image file named by the YFS_DISK env var
+// (in memory if unset), of YFS_DISK_SIZE bytes (DISK_SIZE if unset).
+// An image that already holds a file system is mounted as is. The
+// block cache has YFS_BCACHE bytes of buffers (BCACHE_SIZE if unset).
 block_manager::block_manager()
 {
-  d = new disk();
+  const char *path = getenv("YFS_DISK");
+  uint32_t nblocks = BLOCK_NUM;
 
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+  VERIFY(pthread_mutex_init(&alloc_mutex, NULL) == 0);
 
-  int blks_inode = INODE_NUM / IPB;
-  // blocks to store super block, block bitmap, inode table
-  int minDataBlkId = 1 + 8 + blks_inode;
-  for (int i = 1; i <= minDataBlkId; i++) {
-    using_blocks.insert(std::map<uint32_t, int>::value_type(i, i <= minDataBlkId));
+  char *size_env = getenv("YFS_DISK_SIZE");
+  if (size_env != NULL)
+    nblocks = strtoull(size_env, NULL, 0) / BLOCK_SIZE;
+  if (nblocks <= DBLOCK(nblocks)) {
+    ylog(JSL_DBG_3, "\tbm: disk too small, use %d bytes instead\n",
+         DISK_SIZE);
+    nblocks = BLOCK_NUM;
   }
-  // mark corresponding bit in bit map 1
-  for (int i = 0; i < (minDataBlkId + 4095) / 4096; i++) {
-    char block_buf[BLOCK_SIZE];
-    memset(block_buf, 0, sizeof(block_buf));
-    for (int j = 0; j < minDataBlkId - 4096 * i; i++) {
-      int cid = j / 8;
-      int bit_offset = j % 8;
-      block_buf[cid] |= 1 << bit_offset;
-    }
-    write_block(i + 1, block_buf);
+
+  d = new disk(path, nblocks);
+  if (d->size() <= DBLOCK(d->size())) {
+    ylog(JSL_DBG_2, "\tbm: error! image %s too small\n", path);
+    exit(1);
   }
+  char *cache_env = getenv("YFS_BCACHE");
+  bc = new block_cache(d, (cache_env ? strtoull(cache_env, NULL, 0)
+                                     : BCACHE_SIZE) / BLOCK_SIZE);
+
+  char buf[BLOCK_SIZE];
+  d->read_block(1, buf);
+  memcpy(&sb, buf, sizeof(sb));
+  if (sb.magic == FS_MAGIC && sb.nblocks == d->size() &&
+      sb.ninodes == INODE_NUM)
+    mount();
+  else
+    format();
+}
+
+void
+block_manager::format()
+{
+  formatted = true;
+
+  sb.size = BLOCK_SIZE * d->size();
+  sb.nblocks = d->size();
+  sb.ninodes = INODE_NUM;
+  sb.magic = FS_MAGIC;
+
+  // blocks to store boot block, super block, block bitmap, inode table
+  uint32_t minDataBlkId = DBLOCK(sb.nblocks);
+  init_bitmap();
+  for (uint32_t i = 0; i < minDataBlkId; i++)
+    mark(i, true);
+  for (uint32_t i = sb.nblocks; i < bitmap.size() * 64; i++)
+    mark(i, true);
+  nfree = sb.nblocks - minDataBlkId;
+  flush_bitmap();
+
+  // an image file may hold garbage, clear the inode bitmap and table
+  char block_buf[BLOCK_SIZE];
+  memset(block_buf, 0, sizeof(block_buf));
+  for (uint32_t i = IMBLOCK(sb.nblocks); i < minDataBlkId; i++)
+    write_block(i, block_buf);
+
+  // the super block goes last, so a half-formatted disk is never mounted
+  memcpy(block_buf, &sb, sizeof(sb));
+  write_block(1, block_buf);
+  sync();
+}
+
+void
+block_manager::mount()
+{
+  formatted = false;
+
+  // load the on-disk bitmap and count the free blocks
+  init_bitmap();
+  for (uint32_t i = 0; i < bitmap_dirty.size(); i++)
+    read_block(i + 2, (char *)&bitmap[i * WPB]);
+  for (uint32_t i = sb.nblocks; i < bitmap.size() * 64; i++)
+    bitmap[i / 64] |= 1ULL << (i % 64);
+  uint32_t used = 0;
+  for (uint32_t w = 0; w < bitmap.size(); w++)
+    used += __builtin_popcountll(bitmap[w]);
+  nfree = bitmap.size() * 64 - used;
+}
+
+void
+block_manager::init_bitmap()
+{
+  uint32_t nbitmap = (sb.nblocks + BPB - 1) / BPB;
+  bitmap.assign(nbitmap * WPB, 0);
+  bitmap_dirty.assign(nbitmap, false);
+  cursor = DBLOCK(sb.nblocks);
 }
 
 void
 block_manager::read_block(uint32_t id, char *buf)
 {
-  d->read_block(id, buf);
+  bc->read(id, buf);
 }
 
 void
 block_manager::write_block(uint32_t id, const char *buf)
 {
-  d->write_block(id, buf);
+  bc->write(id, buf);
+}
+
+void
+block_manager::read_blocks(uint32_t id, uint32_t n, char *buf)
+{
+  bc->read_blocks(id, n, buf);
+}
+
+void
+block_manager::write_blocks(uint32_t id, uint32_t n, const char *buf)
+{
+  bc->write_blocks(id, n, buf);
+}
+
+// The cached copy of block id, to read or change in place until
+// unpin_block(); changed says whether it was.
+char *
+block_manager::pin_block(uint32_t id)
+{
+  return bc->pin(id);
+}
+
+void
+block_manager::unpin_block(uint32_t id, bool changed)
+{
+  bc->unpin(id, changed);
+}
+
+void
+block_manager::sync()
+{
+  flush_bitmap();
+  bc->flush();
+  d->sync();
 }
 
 // inode layer -----------------------------------------
 
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
 inode_manager::inode_manager()
 {
   bm = new block_manager();
+  VERIFY(pthread_mutex_init(&imap_mutex, NULL) == 0);
+  VERIFY(pthread_mutex_init(&itable_mutex, NULL) == 0);
+  for (uint32_t i = 0; i < INODE_NUM; i++)
+    VERIFY(pthread_mutex_init(&ilocks[i], NULL) == 0);
+  itable.resize(INODE_NUM);
+  iblock_loaded.assign((INODE_NUM + IPB - 1) / IPB, false);
+  iblock_dirty.assign((INODE_NUM + IPB - 1) / IPB, false);
+  extlists.resize(INODE_NUM);
+  extlist_loaded.assign(INODE_NUM, false);
+  load_imap();
+  if (!bm->formatted) {
+    // mounted an existing file system, the root dir is already there
+    struct inode root;
+    if (!get_inode(1, &root)) {
+      ylog(JSL_DBG_2, "\tim: error! no root dir on disk\n");
+      exit(0);
+    }
+    return;
+  }
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
-    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+    ylog(JSL_DBG_2, "\tim: error! alloc first inode %d, should be 1\n",
+         root_dir);
     exit(0);
   }
+  // the new file system is only complete with its root dir
+  sync();
+}
+
+/* Block until everything written so far is on stable storage. */
+void
+inode_manager::sync()
+{
+  {
+    ScopedLock ml(&imap_mutex);
+    flush_imap();
+  }
+  flush_inodes();
+  bm->sync();
+}
+
+/* Load the inode bitmap and count the free inodes.
+ * Inode 0 and the bits past INODE_NUM are never handed out. */
+void
+inode_manager::load_imap()
+{
+  imap.assign(IMBLOCKS * WPB, 0);
+  for (uint32_t i = 0; i < IMBLOCKS; i++)
+    bm->read_block(IMBLOCK(bm->sb.nblocks) + i, (char *)&imap[i * WPB]);
+  imap[0] |= 1;
+  for (uint32_t i = INODE_NUM; i < imap.size() * 64; i++)
+    imap[i / 64] |= 1ULL << (i % 64);
+
+  uint32_t used = 0;
+  for (uint32_t w = 0; w < imap.size(); w++)
+    used += __builtin_popcountll(imap[w]);
+  nfree_inodes = imap.size() * 64 - used;
+  imap_dirty = false;
+  icursor = 1;
+}
+
+/* Write the inode bitmap back to disk if it changed.
+ * Caller holds imap_mutex. */
+void
+inode_manager::flush_imap()
+{
+  if (!imap_dirty)
+    return;
+  for (uint32_t i = 0; i < IMBLOCKS; i++)
+    bm->write_block(IMBLOCK(bm->sb.nblocks) + i, (const char *)&imap[i * WPB]);
+  imap_dirty = false;
 }
 
 /* Create a new file.
- * Return its inum. */
+ * Return its inum, 0 if all inodes are in use.
+ * The free inode comes from the inode bitmap, next-fit from the last
+ * one handed out, without looking at the inode table. */
 uint32_t
 inode_manager::alloc_inode(uint32_t type)
 {
@@ -131,21 +747,36 @@ inode_manager::alloc_inode(uint32_t type)
    * note: the normal inode block should begin from the 2nd inode block.
    * the 1st is used for root_dir, see inode_manager::inode_manager().
    */
-  for (uint32_t i = 1; i != INODE_NUM; i++) {
-    fflush(stdout);
-    if (!get_inode(i)) {
-      struct inode ino;
-      memset(&ino, 0, sizeof(struct inode));
-      ino.type = type;
-      std::time_t t = std::time(NULL);
-      ino.atime = t;
-      ino.mtime = t;
-      ino.ctime = t;
-      put_inode(i, &ino);
-      return i;
-    }
+  ScopedLock ml(&imap_mutex);
+  if (nfree_inodes == 0) {
+    ylog(JSL_DBG_2, "\tim: error! no free inode\n");
+    return 0;
+  }
+
+  uint32_t nwords = imap.size();
+  uint32_t w = icursor / 64;
+  uint64_t word = imap[w] | ((1ULL << (icursor % 64)) - 1);
+  while (!~word) {
+    w = (w + 1) % nwords;
+    word = imap[w];
   }
-  return -1;
+  uint32_t inum = w * 64 + __builtin_ctzll(~word);
+  imap[w] |= 1ULL << (inum % 64);
+  imap_dirty = true;
+  nfree_inodes--;
+  icursor = inum + 1 < INODE_NUM ? inum + 1 : 1;
+
+  struct inode ino;
+  memset(&ino, 0, sizeof(struct inode));
+  ino.type = type;
+  std::time_t t = std::time(NULL);
+  ino.atime = t;
+  ino.mtime = t;
+  ino.ctime = t;
+  put_inode(inum, &ino);
+  flush_inodes();
+  flush_imap();
+  return inum;
 }
 
 void
@@ -156,78 +787,430 @@ inode_manager::free_inode(uint32_t inum)
    * note: you need to check if the inode is already a freed one;
    * if not, clear it, and remember to write back to disk.
    */
-  struct inode* ino = get_inode(inum);
+  if (inum >= INODE_NUM)
+    return;
+  ScopedLock il(&ilocks[inum]);
+  struct inode node, *ino = get_inode(inum, &node);
   if (!ino) return;
-  int i = 0;
-  int nblks = ( ino->size + BLOCK_SIZE - 1) /  BLOCK_SIZE;
-  int tmp = nblks < NDIRECT ? nblks : NDIRECT;
-  for (; i != tmp; i++) {
-    bm->free_block(ino->blocks[i]);
-  } 
-  if (nblks > NDIRECT) {
-    blockid_t bid = ino->blocks[NDIRECT]; 
-    char block_buf[BLOCK_SIZE];
-    bm->read_block(bid, block_buf);
-    bm->free_block(bid);
-    uint *sec_block = (uint *)block_buf;
-    for (; i < nblks; i++) {
-      bm->free_block(sec_block[i - NDIRECT]);
-    }
-  }
+  std::vector<extent_t> &ext = load_extents(inum, ino);
+  for (unsigned int i = 0; i < ext.size(); i++)
+    bm->free_extent(ext[i].start, ext[i].len);
+  ext.clear();
+  store_extents(ino, ext);
+  bm->flush_bitmap();
   memset(ino, 0, sizeof(struct inode));
   put_inode(inum, ino);
-  free(ino);
+  flush_inodes();
+
+  // only now may the inode be handed out again
+  ScopedLock ml(&imap_mutex);
+  imap[inum / 64] &= ~(1ULL << (inum % 64));
+  imap_dirty = true;
+  nfree_inodes++;
+  flush_imap();
   return;
 }
 
+/* Return the cached copy of inode inum, reading its inode block
+ * into the table on first use. Caller holds itable_mutex. */
+struct inode *
+inode_manager::cached_inode(uint32_t inum)
+{
+  uint32_t b = inum / IPB;
+  if (!iblock_loaded[b]) {
+    char buf[BLOCK_SIZE];
+    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+    uint32_t n = MIN(IPB, INODE_NUM - b * IPB);
+    memcpy(&itable[b * IPB], buf, n * sizeof(struct inode));
+    iblock_loaded[b] = true;
+  }
+  return &itable[inum];
+}
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-struct inode* 
-inode_manager::get_inode(uint32_t inum)
+/* Write every dirty inode block back to disk. */
+void
+inode_manager::flush_inodes()
 {
-  struct inode *ino, *ino_disk;
-  char buf[BLOCK_SIZE];
+  ScopedLock tl(&itable_mutex);
+  for (unsigned int i = 0; i < dirty_iblocks.size(); i++) {
+    uint32_t b = dirty_iblocks[i];
+    char buf[BLOCK_SIZE];
+    uint32_t n = MIN(IPB, INODE_NUM - b * IPB);
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, &itable[b * IPB], n * sizeof(struct inode));
+    bm->write_block(IBLOCK(b * IPB, bm->sb.nblocks), buf);
+    iblock_dirty[b] = false;
+  }
+  dirty_iblocks.clear();
+}
 
-  printf("\tim: get_inode %d\n", inum);
+/* Copy inode inum out of the inode table into *ino and return ino,
+ * NULL if the inode is free. Nothing is allocated; changes to the copy
+ * only reach the table after put_inode(). */
+struct inode* 
+inode_manager::get_inode(uint32_t inum, struct inode *ino)
+{
+  ylog(JSL_DBG_4, "\tim: get_inode %d\n", inum);
 
   if (inum < 0 || inum >= INODE_NUM) {
-    printf("\tim: inum out of range\n");
+    ylog(JSL_DBG_2, "\tim: inum out of range\n");
     return NULL;
   }
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  // printf("%s:%d\n", __FILE__, __LINE__);
-
-  ino_disk = (struct inode*)buf + inum%IPB;
-  if (ino_disk->type == 0) {
-    printf("\tim: inode not exist\n");
+  ScopedLock tl(&itable_mutex);
+  *ino = *cached_inode(inum);
+  if (ino->type == 0) {
+    ylog(JSL_DBG_4, "\tim: inode not exist\n");
     return NULL;
   }
 
-  ino = (struct inode*)malloc(sizeof(struct inode));
-  *ino = *ino_disk;
-
   return ino;
 }
 
+/* Store ino as inode inum in the inode table;
+ * the disk copy is written back by the next flush_inodes(). */
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
+  ylog(JSL_DBG_4, "\tim: put_inode %d\n", inum);
+  if (ino == NULL || inum >= INODE_NUM)
+    return;
+
+  ScopedLock tl(&itable_mutex);
+  *cached_inode(inum) = *ino;
+  uint32_t b = inum / IPB;
+  if (!iblock_dirty[b]) {
+    iblock_dirty[b] = true;
+    dirty_iblocks.push_back(b);
+  }
+}
 
-  printf("\tim: put_inode %d\n", inum);
-  if (ino == NULL)
+// Extent slots under an index block of the given depth: an extent
+// block is depth 0, a block of pointers to depth d - 1 blocks depth d.
+static uint32_t
+index_span(int depth)
+{
+  uint32_t n = NINDIRECT;
+  while (depth-- > 0)
+    n *= NPTR;
+  return n;
+}
+
+/* Allocate an index block, zeroed, i.e. pointing nowhere.
+ * Return 0 if the disk is full. */
+blockid_t
+inode_manager::new_index_block()
+{
+  blockid_t b = bm->alloc_block();
+  if (b) {
+    char zeros[BLOCK_SIZE];
+    memset(zeros, 0, BLOCK_SIZE);
+    bm->write_block(b, zeros);
+  }
+  return b;
+}
+
+/* The extent block holding extent slot k (k >= NDIRECT) of ino, whose
+ * slot in it is (k - NDIRECT) % NINDIRECT. With alloc, missing index
+ * blocks on the way are allocated. Return 0 if there is none, or k is
+ * past MAXEXTENT. The index blocks are read in place in the block
+ * cache, so walking them costs no copies once they are cached. */
+blockid_t
+inode_manager::extent_block(struct inode *ino, uint32_t k, bool alloc)
+{
+  blockid_t *root;
+  int depth;
+  k -= NDIRECT;
+  if (k < NINDIRECT) {
+    root = &ino->indirect;
+    depth = 0;
+  } else if ((k -= NINDIRECT) < NDINDIRECT) {
+    root = &ino->dindirect;
+    depth = 1;
+  } else if ((k -= NDINDIRECT) < NTINDIRECT) {
+    root = &ino->tindirect;
+    depth = 2;
+  } else {
+    return 0;
+  }
+
+  if (*root == 0 && (!alloc || (*root = new_index_block()) == 0))
+    return 0;
+  blockid_t b = *root;
+  for (; depth > 0; depth--) {
+    uint32_t span = index_span(depth - 1);
+    blockid_t *ptrs = (blockid_t *)bm->pin_block(b);
+    blockid_t child = ptrs[k / span];
+    bool changed = false;
+    if (child == 0 && alloc && (child = new_index_block()) != 0) {
+      ptrs[k / span] = child;
+      changed = true;
+    }
+    bm->unpin_block(b, changed);
+    if (child == 0)
+      return 0;
+    b = child;
+    k %= span;
+  }
+  return b;
+}
+
+/* Free index block b of the given depth and every block under it. */
+void
+inode_manager::free_index(blockid_t b, int depth)
+{
+  if (depth > 0) {
+    blockid_t ptrs[NPTR];
+    memcpy(ptrs, bm->pin_block(b), sizeof(ptrs));
+    bm->unpin_block(b, false);
+    for (uint32_t i = 0; i < NPTR; i++) {
+      if (ptrs[i])
+        free_index(ptrs[i], depth - 1);
+    }
+  }
+  bm->free_block(b);
+}
+
+/* Free the index blocks under b (of the given depth) that map none of
+ * its first keep extent slots; b itself too if keep is 0. */
+void
+inode_manager::trim_index(blockid_t &b, int depth, uint32_t keep)
+{
+  if (b == 0)
+    return;
+  if (keep == 0) {
+    free_index(b, depth);
+    b = 0;
+    return;
+  }
+  if (depth == 0)
     return;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode*)buf + inum%IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  uint32_t span = index_span(depth - 1);
+  blockid_t *ptrs = (blockid_t *)bm->pin_block(b);
+  bool changed = false;
+  for (uint32_t i = (keep - 1) / span; i < NPTR; i++) {
+    blockid_t child = ptrs[i];
+    uint32_t child_keep = keep > i * span ? keep - i * span : 0;
+    if (child == 0 || child_keep >= span)
+      continue;
+    trim_index(child, depth - 1, child_keep);
+    if (child != ptrs[i]) {
+      ptrs[i] = child;
+      changed = true;
+    }
+  }
+  bm->unpin_block(b, changed);
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
+/* The extent list of inode inum (whose copy is ino), direct extents
+ * first. It is read from the extent blocks on first use and kept, so
+ * that an operation on a file with many extents does not walk them
+ * again; changes to it must be saved with store_extents(). Caller holds
+ * the inode's lock. */
+std::vector<extent_t> &
+inode_manager::load_extents(uint32_t inum, struct inode *ino)
+{
+  std::vector<extent_t> &ext = extlists[inum];
+  if (extlist_loaded[inum])
+    return ext;
+
+  ext.assign(ino->extents, ino->extents + MIN(ino->nextents, NDIRECT));
+  for (uint32_t k = NDIRECT; k < ino->nextents; k += NINDIRECT) {
+    blockid_t b = extent_block(ino, k, false);
+    if (b == 0) {
+      ylog(JSL_DBG_2, "\tim: error! extent %u of %u not mapped\n", k,
+           ino->nextents);
+      break;
+    }
+    extent_t *e = (extent_t *)bm->pin_block(b);
+    ext.insert(ext.end(), e, e + MIN(ino->nextents - k, NINDIRECT));
+    bm->unpin_block(b, false);
+  }
+  extlist_loaded[inum] = true;
+  return ext;
+}
+
+/* Save the extent list into ino and its extent blocks, which must have
+ * been allocated by grow_blocks(). The list only changes at its tail,
+ * so only the extent blocks from the last extent ino had on are looked
+ * at, and written if they changed; index blocks no longer needed are
+ * freed. */
+void
+inode_manager::store_extents(struct inode *ino, const std::vector<extent_t> &ext)
+{
+  uint32_t from = MIN(ino->nextents, ext.size());
+  from = from > NDIRECT + 1 ? from - 1 : NDIRECT;
+  from -= (from - NDIRECT) % NINDIRECT;
+
+  ino->nextents = ext.size();
+  memset(ino->extents, 0, sizeof(ino->extents));
+  for (unsigned int i = 0; i < MIN(ext.size(), NDIRECT); i++)
+    ino->extents[i] = ext[i];
+  for (uint32_t k = from; k < ext.size(); k += NINDIRECT) {
+    blockid_t b = extent_block(ino, k, false);
+    VERIFY(b != 0);
+    char block_buf[BLOCK_SIZE];
+    memset(block_buf, 0, BLOCK_SIZE);
+    memcpy(block_buf, &ext[k],
+           MIN(ext.size() - k, NINDIRECT) * sizeof(extent_t));
+    char *cached = bm->pin_block(b);
+    bool changed = memcmp(cached, block_buf, BLOCK_SIZE) != 0;
+    if (changed)
+      memcpy(cached, block_buf, BLOCK_SIZE);
+    bm->unpin_block(b, changed);
+  }
+
+  uint32_t n = ext.size() > NDIRECT ? ext.size() - NDIRECT : 0;
+  trim_index(ino->indirect, 0, MIN(n, NINDIRECT));
+  n = n > NINDIRECT ? n - NINDIRECT : 0;
+  trim_index(ino->dindirect, 1, MIN(n, NDINDIRECT));
+  n = n > NDINDIRECT ? n - NDINDIRECT : 0;
+  trim_index(ino->tindirect, 2, n);
+}
+
+/* Make the extent list map at least nblks blocks.
+ * New blocks are allocated in runs, right after the last extent if
+ * possible, so a file written sequentially stays contiguous. A growing
+ * file also grabs up to PREALLOC blocks more than it needs, which stay
+ * mapped past the end of file, so files growing side by side do not
+ * chop each other into tiny extents.
+ * Return the number of blocks mapped, less than nblks if the disk is
+ * full or the file is out of extent slots. */
+uint32_t
+inode_manager::grow_blocks(struct inode *ino, std::vector<extent_t> &ext,
+                           uint32_t nblks)
+{
+  uint32_t have = 0;
+  for (unsigned int i = 0; i < ext.size(); i++)
+    have += ext[i].len;
+  uint32_t extra = MIN(have, PREALLOC);
+
+  while (have < nblks) {
+    blockid_t goal = ext.empty() ? 0 : ext.back().start + ext.back().len;
+    blockid_t start;
+    uint32_t got = bm->alloc_extent(goal, nblks - have + extra, &start);
+    extra = 0;
+    if (got == 0) {
+      ylog(JSL_DBG_2, "\tim: error! disk full\n");
+      break;
+    }
+    if (!ext.empty() && goal == start) {
+      ext.back().len += got;
+    } else {
+      if (ext.size() >= NDIRECT && !extent_block(ino, ext.size(), true)) {
+        // out of extent slots, or of blocks for the extent blocks:
+        // leave the exceeding part alone
+        bm->free_extent(start, got);
+        break;
+      }
+      extent_t e;
+      e.start = start;
+      e.len = got;
+      ext.push_back(e);
+    }
+    have += got;
+  }
+  return have;
+}
+
+/* Make the extent list map at most nblks blocks, freeing from the tail. */
+void
+inode_manager::shrink_blocks(std::vector<extent_t> &ext, uint32_t nblks)
+{
+  uint32_t have = 0;
+  for (unsigned int i = 0; i < ext.size(); i++)
+    have += ext[i].len;
+
+  while (have > nblks) {
+    extent_t &e = ext.back();
+    uint32_t cut = MIN(e.len, have - nblks);
+    bm->free_extent(e.start + e.len - cut, cut);
+    e.len -= cut;
+    have -= cut;
+    if (e.len == 0)
+      ext.pop_back();
+  }
+}
+
+/* Translate the nblks file blocks starting at block first into runs
+ * of contiguous disk blocks. */
+void
+inode_manager::map_range(const std::vector<extent_t> &ext, uint32_t first,
+                         uint32_t nblks, std::vector<extent_t> &runs)
+{
+  runs.clear();
+  uint32_t pos = 0;
+  for (unsigned int i = 0; i < ext.size() && nblks > 0; i++) {
+    if (first >= pos + ext[i].len) {
+      pos += ext[i].len;
+      continue;
+    }
+    extent_t r;
+    r.start = ext[i].start + (first - pos);
+    r.len = MIN(ext[i].len - (first - pos), nblks);
+    runs.push_back(r);
+    first += r.len;
+    nblks -= r.len;
+    pos += ext[i].len;
+  }
+}
+
+/* Copy [off, off + n) of a file of size old_size into its blocks.
+ * A gap between old_size and off is filled with zeros. Whole blocks of
+ * data go to disk in one write per run of contiguous blocks. */
+void
+inode_manager::write_blocks(const std::vector<extent_t> &ext, unsigned int off,
+                            const char *buf, unsigned int n,
+                            unsigned int old_size)
+{
+  unsigned int end = off + n;
+  unsigned int start = off > old_size ? old_size : off;
+  unsigned int blks_old = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint32_t first = start / BLOCK_SIZE;
+
+  std::vector<extent_t> runs;
+  map_range(ext, first, (end + BLOCK_SIZE - 1) / BLOCK_SIZE - first, runs);
+
+  uint32_t i = first;
+  for (unsigned int r = 0; r < runs.size(); r++) {
+    for (uint32_t j = 0; j < runs[r].len; ) {
+      unsigned int bstart = (i + j) * BLOCK_SIZE;
+      unsigned int bend = bstart + BLOCK_SIZE;
+      blockid_t bid = runs[r].start + j;
+
+      // whole blocks of data, in one go
+      if (bstart >= off && bend <= end) {
+        uint32_t k = j + 1;
+        while (k < runs[r].len && (i + k + 1) * BLOCK_SIZE <= end)
+          k++;
+        bm->write_blocks(bid, k - j, buf + bstart - off);
+        j = k;
+        continue;
+      }
+
+      // a partial block is changed in place in the block cache
+      char *block_buf = bm->pin_block(bid);
+      if (i + j >= blks_old || (start <= bstart && end >= bend))
+        memset(block_buf, 0, BLOCK_SIZE);
+
+      // zero the gap between the old end of file and off
+      if (off > old_size && old_size < bend && off > bstart) {
+        unsigned int zs = old_size > bstart ? old_size : bstart;
+        unsigned int ze = MIN(off, bend);
+        memset(block_buf + zs - bstart, 0, ze - zs);
+      }
+      if (end > off && off < bend && end > bstart) {
+        unsigned int ds = off > bstart ? off : bstart;
+        unsigned int de = MIN(end, bend);
+        memcpy(block_buf + ds - bstart, buf + ds - off, de - ds);
+      }
+      bm->unpin_block(bid, true);
+      j++;
+    }
+    i += runs[r].len;
+  }
+}
 
 /* Get all the data of a file by inum. 
  * Return alloced data, should be freed by caller. */
@@ -239,62 +1222,15 @@ inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
    * note: read blocks related to inode number inum,
    * and copy them to buf_Out
    */
-  struct inode *ino = get_inode(inum);
-  if (!ino) {
-    *buf_out = NULL;
-    *size = 0;
-    return;
-  }
-  
-  // update access time
-  std::time_t t = std::time(0);
-  ino->atime = t;
-
-  *size = ino->size;
-  
-  blockid_t i = 0;
-  int rest = ino->size;
-  int offset = 0;
-  unsigned int nblks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  char *file_buf = (char *)malloc(sizeof(char) * BLOCK_SIZE * nblks);
-  while (rest > 0 && i < MIN(NDIRECT, nblks)) {
-    // char block_buf[BLOCK_SIZE];
-    bm->read_block(ino->blocks[i], file_buf + offset);
-    // memcpy(file_buf + offset, block_buf, MIN(rest, BLOCK_SIZE));
-    offset += BLOCK_SIZE;
-    rest -= BLOCK_SIZE;
-    i++;
-  }
-  if (nblks > NDIRECT && rest > 0) {
-    
-    // printf("\tim: read indirect index block, nblks: %d, rest: %d\n", nblks, rest);
-
-    blockid_t indir_id = ino->blocks[NDIRECT];
-    char block_buf[BLOCK_SIZE];
-    bm->read_block(indir_id, block_buf);
-
-    // traverse indirect block index 
-    uint *indir_blk = (uint *)block_buf;
-    for (unsigned int j = 0; j != nblks - NDIRECT; j++) {
-      if (rest > 0 && indir_blk[j] > 0) {
-        char buffer[BLOCK_SIZE];
-        bm->read_block(indir_blk[j], buffer);
-        // copy block content into file buffer
-        memcpy(file_buf + offset, buffer, MIN(rest, BLOCK_SIZE));
-        offset += MIN(rest, BLOCK_SIZE);
-        rest -= MIN(rest, BLOCK_SIZE);
-      }
-      else break;
-    }
-  }
-  *buf_out = file_buf;
-  put_inode(inum, ino);
-  free(ino);
+  // read_range cuts n down to the size it finds under the inode lock
+  read_range(inum, 0, UINT_MAX, buf_out, size);
   return;
 }
 
-/* alloc/free blocks if needed */
-void
+/* alloc/free blocks if needed
+ * Return the number of bytes written, less than size if the disk is
+ * full or the file is out of extent slots, -1 if there is no such file. */
+int
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
   /*
@@ -303,126 +1239,162 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
    * you need to consider the situation when the size of buf 
    * is larger or smaller than the size of original inode
    */
-  struct inode *ino = get_inode(inum);
+  if (inum >= INODE_NUM)
+    return -1;
+  ScopedLock il(&ilocks[inum]);
+  struct inode node, *ino = get_inode(inum, &node);
   if (!ino) {
-    printf("Error: File not exists\n");
-    return;
+    ylog(JSL_DBG_2, "Error: File not exists\n");
+    return -1;
   }
 
-  // update modify time
-  std::time_t t;
+  // keep the blocks the file already has, only alloc/free the difference
+  std::vector<extent_t> &ext = load_extents(inum, ino);
+  uint32_t nblks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (nblks > (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+    nblks = grow_blocks(ino, ext, nblks);
+  shrink_blocks(ext, nblks);
+  if (size > (int)(nblks * BLOCK_SIZE))
+    size = nblks * BLOCK_SIZE;
+  store_extents(ino, ext);
+  bm->flush_bitmap();
 
-  blockid_t *blocks = ino->blocks;
-  unsigned int blks_old = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  unsigned int blks_new = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  write_blocks(ext, 0, buf, size, 0);
 
-  // buf needs more blocks
-  if (blks_new > blks_old) {
-    // fill old blocks with new data
-    int offset = 0;
-    unsigned int i = 0;
-    unsigned int maxIdx = MIN(blks_old, NDIRECT);
-    for (; i != maxIdx; i++) {
-      bm->write_block(blocks[i], buf + offset);
-      offset += BLOCK_SIZE;
-    }
-    if (blks_old > NDIRECT) {
-      char blockid_buf[BLOCK_SIZE];
-      bm->read_block(blocks[NDIRECT], blockid_buf);
-      blockid_t *indir_blks = (blockid_t *) blockid_buf;
-      for (unsigned int j = 0; j != blks_old - NDIRECT; j++) {
-        bm->write_block(indir_blks[j], buf + offset);
-        offset += BLOCK_SIZE;
-        i++;
-      }
-    }
-    int rest = size - offset;
+  ino->size = size;
+  std::time_t t = std::time(NULL);
+  ino->ctime = t;
+  ino->mtime = t;
 
-    // if the file is too large, leave the exceeding part alone
-    while (rest > 0 && i < MAXFILE) {
-      // allocate new block to store file content
-      uint32_t bid = bm->alloc_block();
-      bm->write_block(bid, buf + offset);
-      offset += BLOCK_SIZE;
-      rest -= BLOCK_SIZE;
-
-      // put block id into inode
-      if (i < NDIRECT) {
-        blocks[i] = bid;
-      }
-      // allocate new block for storing indirect index block
-      else if (i == NDIRECT) {
-        uint32_t idx_blk_id = bm->alloc_block();
-        blocks[NDIRECT] = idx_blk_id;
-        char idx_blk[BLOCK_SIZE];
-        blockid_t *blkid = (blockid_t *)idx_blk;
-        blkid[0] = bid;
-        bm->write_block(idx_blk_id, idx_blk);
-      }
-      else {
-        char blockid_buf[BLOCK_SIZE];
-        bm->read_block(blocks[NDIRECT], blockid_buf);
-        blockid_t *blkid = (blockid_t *)blockid_buf;
-        blkid[i - NDIRECT] = bid;
-        bm->write_block(blocks[NDIRECT], blockid_buf);
-      }
-      i++;
-    }
+  put_inode(inum, ino);
+  flush_inodes();
+  return size;
+}
+
+/* Get @n bytes of file inum starting at byte @off.
+ * Only the blocks covering [off, off + n) are read, whole blocks in
+ * one copy per run of contiguous blocks.
+ * Return alloced data, should be freed by caller. */
+void
+inode_manager::read_range(uint32_t inum, unsigned int off, unsigned int n,
+                          char **buf_out, int *size)
+{
+  *buf_out = NULL;
+  *size = 0;
+
+  if (inum >= INODE_NUM)
+    return;
+  ScopedLock il(&ilocks[inum]);
+  struct inode node, *ino = get_inode(inum, &node);
+  if (!ino)
+    return;
+
+  // atime alone is not worth a write, it goes out with the next flush
+  ino->atime = std::time(0);
+
+  if (off >= ino->size || n == 0) {
+    put_inode(inum, ino);
+    return;
   }
-  // new file needs no more blocks than old file
-  else {
-    int offset = 0;
-    int rest = size;
-    unsigned int maxIdx = MIN(blks_new, NDIRECT);
-    unsigned int i = 0;
-    for (; i != maxIdx && rest > 0; i++) {
-      bm->write_block(blocks[i], buf + offset);
-      offset += BLOCK_SIZE;
-      rest -= BLOCK_SIZE;
-    }
-    // file is large, using indirect indexing block
-    if (rest > 0 && blks_new > NDIRECT) {
-      char blockid_buf[BLOCK_SIZE];
-      bm->read_block(blocks[NDIRECT], blockid_buf);
-      blockid_t *indir_blks = (blockid_t *) blockid_buf;
-      for (; i != blks_new && rest > 0; i++) {
-        bm->write_block(indir_blks[i - NDIRECT], buf + offset);
-        offset += BLOCK_SIZE;
-        rest -= BLOCK_SIZE;
-      }
-      for (; i < blks_old; i++) {
-        bm->free_block(indir_blks[i - NDIRECT]);
+  if (n > ino->size - off)
+    n = ino->size - off;
+
+  std::vector<extent_t> &ext = load_extents(inum, ino);
+  std::vector<extent_t> runs;
+  uint32_t first = off / BLOCK_SIZE;
+  map_range(ext, first, (off + n - 1) / BLOCK_SIZE - first + 1, runs);
+
+  char *file_buf = (char *)malloc(n);
+  unsigned int done = 0;
+  for (unsigned int r = 0; r < runs.size(); r++) {
+    for (uint32_t j = 0; j < runs[r].len; ) {
+      unsigned int boff = (off + done) % BLOCK_SIZE;
+      unsigned int whole = (n - done) / BLOCK_SIZE;
+      if (boff == 0 && whole > 0) {
+        uint32_t k = MIN(whole, runs[r].len - j);
+        bm->read_blocks(runs[r].start + j, k, file_buf + done);
+        done += k * BLOCK_SIZE;
+        j += k;
+        continue;
       }
+      char block_buf[BLOCK_SIZE];
+      unsigned int len = MIN(BLOCK_SIZE - boff, n - done);
+      bm->read_block(runs[r].start + j, block_buf);
+      memcpy(file_buf + done, block_buf + boff, len);
+      done += len;
+      j++;
     }
-    // file is small, no need for indirect indexing block
-    else {
-      for (; i < MIN(NDIRECT, blks_old); i++) {
-        bm->free_block(blocks[i]);
-        blocks[i] = 0;
-      }
-      // if original file is large, free indirect block
-      if (blks_old > NDIRECT) {
-        char blockid_buf[BLOCK_SIZE];
-        bm->read_block(blocks[NDIRECT], blockid_buf);
-        blockid_t *indir_blks = (blockid_t *) blockid_buf;
-        
-        for (; i < blks_old; i++) {
-          bm->free_block(indir_blks[i - NDIRECT]);
-        }
-        bm->free_block(blocks[i]);
-        blocks[i] = 0;
-      }
+  }
+
+  *buf_out = file_buf;
+  *size = n;
+  put_inode(inum, ino);
+  return;
+}
+
+/* Write @size bytes of buf into file inum at byte @off.
+ * The file grows if needed, and a gap between the old end of file
+ * and @off is filled with zeros. Only the blocks covering the gap
+ * and [off, off + size) are touched.
+ * Return the number of bytes written, less than size if the disk is
+ * full, the file is out of extent slots or would pass MAXSIZE bytes;
+ * -1 if there is no such file. */
+int
+inode_manager::write_range(uint32_t inum, unsigned int off, const char *buf,
+                           int size)
+{
+  if (inum >= INODE_NUM)
+    return -1;
+  ScopedLock il(&ilocks[inum]);
+  struct inode node, *ino = get_inode(inum, &node);
+  if (!ino) {
+    ylog(JSL_DBG_2, "Error: File not exists\n");
+    return -1;
+  }
+  if (size <= 0 || off >= extent_protocol::MAXSIZE)
+    return 0;
+
+  unsigned int old_size = ino->size;
+  unsigned int end = MIN((uint64_t)off + size, extent_protocol::MAXSIZE);
+  unsigned int blks_old = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  unsigned int blks_new = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  std::vector<extent_t> &ext = load_extents(inum, ino);
+  if (blks_new > blks_old) {
+    uint32_t had = 0;
+    for (unsigned int i = 0; i < ext.size(); i++)
+      had += ext[i].len;
+    uint32_t nblks = grow_blocks(ino, ext, blks_new);
+    // if the file is too large, leave the exceeding part alone
+    if (end > nblks * BLOCK_SIZE)
+      end = nblks * BLOCK_SIZE;
+    if (off >= end) {
+      // nothing of the write fits: give back the blocks grown for the
+      // gap, and keep the inode in step with the cached extent list
+      shrink_blocks(ext, had);
+      store_extents(ino, ext);
+      bm->flush_bitmap();
+      put_inode(inum, ino);
+      flush_inodes();
+      return 0;
     }
+    store_extents(ino, ext);
+    bm->flush_bitmap();
   }
-  ino->size = size;
-  t = std::time(NULL);
+  if (off >= end)
+    return 0;
+
+  write_blocks(ext, off, buf, end - off, old_size);
+
+  if (end > old_size)
+    ino->size = end;
+  std::time_t t = std::time(NULL);
   ino->ctime = t;
-  t = std::time(NULL);
   ino->mtime = t;
 
   put_inode(inum, ino);
-  free(ino);
-  return;
+  flush_inodes();
+  return end - off;
 }
 
 void
@@ -433,7 +1405,7 @@ inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
    * note: get the attributes of inode inum.
    * you can refer to "struct attr" in extent_protocol.h
    */
-  struct inode *ino = get_inode(inum);
+  struct inode node, *ino = get_inode(inum, &node);
   if (!ino) {
     memset(&a, 0, sizeof(a));
     return;
@@ -443,10 +1415,21 @@ inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
   a.atime = ino->atime;
   a.ctime = ino->ctime;
   a.mtime = ino->mtime;
-  free(ino);
   return;
 }
 
+/* Report the size of the file system and what is left of it. */
+void
+inode_manager::statfs(extent_protocol::fsstat &st)
+{
+  st.bsize = BLOCK_SIZE;
+  st.blocks = bm->sb.nblocks - DBLOCK(bm->sb.nblocks);
+  st.bfree = bm->free_blocks();
+  st.files = INODE_NUM - 1;
+  ScopedLock ml(&imap_mutex);
+  st.ffree = nfree_inodes;
+}
+
 void
 inode_manager::remove_file(uint32_t inum)
 {
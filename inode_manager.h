@@ -4,8 +4,13 @@
 #define inode_h
 
 #include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include <set>
 #include "extent_protocol.h" // TODO: delete it
 
+// default disk size, override with the YFS_DISK_SIZE env var
 #define DISK_SIZE  1024*1024*16
 #define BLOCK_SIZE 512
 #define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
@@ -14,36 +19,119 @@ typedef uint32_t blockid_t;
 
 // disk layer -----------------------------------------
 
+// The disk is a memory mapping of an image file, so blocks live in the
+// page cache and survive restarts. Without an image file the mapping is
+// anonymous, i.e. an in-memory disk that is zero-filled on first touch.
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  uint32_t nblocks;
+  int fd;   // image file, -1 for an in-memory disk
 
  public:
-  disk();
+  disk(const char *path, uint32_t nblocks);
+  ~disk();
+  uint32_t size() { return nblocks; }
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t n, char *buf);
+  void write_blocks(uint32_t id, uint32_t n, const char *buf);
+  // barrier: returns once every block written so far is durable
+  void sync();
 };
 
 // block layer -----------------------------------------
 
+#define FS_MAGIC 0x79667334  // "yfs4"
+
 typedef struct superblock {
   uint32_t size;
   uint32_t nblocks;
   uint32_t ninodes;
+  uint32_t magic;
 } superblock_t;
 
+// Buffers in front of the disk for the blocks read and written one at a
+// time: metadata, and the partial blocks of files. Replacement is the
+// clock algorithm, and a pinned buffer is never replaced. A write stays
+// in its buffer until the buffer is replaced or flushed; a thread
+// flushes every cache every YFS_BCACHE_FLUSH seconds, and at exit().
+// Multi-block reads and writes go to the disk, seeing and updating the
+// buffers on the way.
+class block_cache {
+ private:
+  struct buf {
+    blockid_t id;
+    bool valid;
+    bool ref;   // used since the clock hand last passed
+    int pins;
+    char data[BLOCK_SIZE];
+  };
+  disk *d;
+  std::vector<buf *> bufs;
+  std::map<blockid_t, buf *> index;
+  std::set<blockid_t> dirty;
+  uint32_t hand;
+  pthread_mutex_t m;  // guards all of the above, and buffer contents
+                      // other than those of pinned buffers
+
+  buf *get(blockid_t id, bool load);
+  buf *victim();
+  void writeback(buf *b);
+  void flush_locked();
+ public:
+  block_cache(disk *d, uint32_t nbufs);
+  void read(blockid_t id, char *data);
+  void write(blockid_t id, const char *data);
+  void read_blocks(blockid_t id, uint32_t n, char *data);
+  void write_blocks(blockid_t id, uint32_t n, const char *data);
+  // The buffer of block id, which stays put until unpin(); the caller
+  // may change it in place if it says so to unpin().
+  char *pin(blockid_t id);
+  void unpin(blockid_t id, bool changed);
+  // drop the buffers of blocks no longer in use, changes included
+  void forget(blockid_t id, uint32_t n);
+  void flush();
+  static void flush_all();
+};
+
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  block_cache *bc;
+  // in-memory copy of the block bitmap, and which bitmap blocks
+  // differ from their on-disk copy
+  std::vector<uint64_t> bitmap;
+  std::vector<bool> bitmap_dirty;
+  uint32_t cursor;  // where the next free block search starts
+  uint32_t nfree;
+  pthread_mutex_t alloc_mutex;  // the allocator lock, guards all of the above
+
+  void format();
+  void mount();
+  void init_bitmap();
+  void mark(uint32_t id, bool used);
+  void release(uint32_t id);
+  blockid_t find_free(uint32_t from, uint32_t to);
  public:
   block_manager();
   struct superblock sb;
+  bool formatted;  // true if the disk was blank and has just been formatted
 
   uint32_t alloc_block();
+  uint32_t alloc_blocks(uint32_t n, blockid_t *ids);
+  uint32_t alloc_extent(blockid_t goal, uint32_t n, blockid_t *start);
   void free_block(uint32_t id);
+  void free_extent(blockid_t start, uint32_t n);
+  uint32_t free_blocks();
+  void flush_bitmap();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t n, char *buf);
+  void write_blocks(uint32_t id, uint32_t n, const char *buf);
+  char *pin_block(uint32_t id);
+  void unpin_block(uint32_t id, bool changed);
+  void sync();
 };
 
 // inode layer -----------------------------------------
@@ -51,11 +139,16 @@ class block_manager {
 #define INODE_NUM  1024
 
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB           (BLOCK_SIZE / sizeof(struct inode))
+
+// First block of the inode bitmap, right after the block bitmap
+#define IMBLOCK(nblocks)  ((nblocks)/BPB + 3)
+
+// Blocks in the inode bitmap
+#define IMBLOCKS      ((INODE_NUM + BPB - 1) / BPB)
 
 // Block containing inode i
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
+#define IBLOCK(i, nblocks)     (IMBLOCK(nblocks) + IMBLOCKS + (i)/IPB)
 
 // Bitmap bits per block
 #define BPB           (BLOCK_SIZE*8)
@@ -63,9 +156,30 @@ class block_manager {
 // Block containing bit for block b
 #define BBLOCK(b) ((b)/BPB + 2)
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// First data block, right after the inode table
+#define DBLOCK(nblocks)   IBLOCK(INODE_NUM, nblocks)
+
+// A file's blocks are mapped by extents, i.e. runs of contiguous blocks.
+typedef struct extent {
+  blockid_t start;
+  uint32_t len;     // in blocks
+} extent_t;
+
+// The extents past the first NDIRECT are kept in extent blocks of
+// NINDIRECT each: one for the next NINDIRECT extents (indirect), then
+// up to NPTR of them under a block of pointers (dindirect), then up to
+// NPTR * NPTR under a block of pointers to blocks of pointers
+// (tindirect).
+#define NDIRECT 10
+#define NINDIRECT (BLOCK_SIZE / sizeof(extent_t))
+#define NPTR (BLOCK_SIZE / sizeof(blockid_t))
+#define NDINDIRECT (NPTR * NINDIRECT)
+#define NTINDIRECT (NPTR * NPTR * NINDIRECT)
+#define MAXEXTENT (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+// Max file size in blocks if no two blocks of the file are contiguous
+#define MAXFILE MAXEXTENT
+// Max blocks a growing file allocates past what it needs
+#define PREALLOC 16
 
 typedef struct inode {
   short type;
@@ -73,23 +187,81 @@ typedef struct inode {
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  uint32_t nextents;
+  extent_t extents[NDIRECT];   // First extents of the file
+  blockid_t indirect;          // Extent block holding the next ones
+  blockid_t dindirect;         // Pointers to extent blocks
+  blockid_t tindirect;         // Pointers to blocks of pointers
 } inode_t;
 
+// Locking: an operation on an inode holds that inode's lock in ilocks
+// throughout. The inode bitmap, the inode table and the block allocator
+// have their own locks, only held inside inode_manager and block_manager
+// methods. Locks are taken in this order, never the other way round:
+//
+//   ilocks[inum] -> imap_mutex -> itable_mutex -> alloc_mutex -> block_cache m
+//
+// alloc_inode holds imap_mutex while it stores the new inode and writes
+// back the inode table. flush_inodes, flush_imap and flush_bitmap, and
+// the inode table loading, go through the block cache with their own
+// lock held. The block cache takes no lock while holding m.
 class inode_manager {
  private:
   block_manager *bm;
-  struct inode* get_inode(uint32_t inum);
+  pthread_mutex_t ilocks[INODE_NUM];
+  pthread_mutex_t itable_mutex;  // itable and its loaded/dirty state
+  pthread_mutex_t imap_mutex;    // the inode bitmap and its counters
+  // in-memory copy of the inode table, filled one inode block at a
+  // time; a dirty inode block is only written back by flush_inodes()
+  std::vector<struct inode> itable;
+  std::vector<bool> iblock_loaded;
+  std::vector<bool> iblock_dirty;
+  std::vector<uint32_t> dirty_iblocks;
+  // the extent list of each inode used so far, as its extent blocks
+  // have it; guarded by the inode's lock, so the flags are one byte
+  // each rather than packed bits, which would share words across locks
+  std::vector<std::vector<extent_t> > extlists;
+  std::vector<char> extlist_loaded;
+  // in-memory copy of the inode bitmap, a set bit is an inode in use
+  std::vector<uint64_t> imap;
+  bool imap_dirty;
+  uint32_t icursor;  // where the next free inode search starts
+  uint32_t nfree_inodes;
+
+  void load_imap();
+  void flush_imap();
+
+  struct inode* cached_inode(uint32_t inum);
+  void flush_inodes();
+  struct inode* get_inode(uint32_t inum, struct inode *ino);
   void put_inode(uint32_t inum, struct inode *ino);
+  blockid_t new_index_block();
+  blockid_t extent_block(struct inode *ino, uint32_t k, bool alloc);
+  void free_index(blockid_t b, int depth);
+  void trim_index(blockid_t &b, int depth, uint32_t keep);
+  std::vector<extent_t> &load_extents(uint32_t inum, struct inode *ino);
+  void store_extents(struct inode *ino, const std::vector<extent_t> &ext);
+  uint32_t grow_blocks(struct inode *ino, std::vector<extent_t> &ext,
+                       uint32_t nblks);
+  void shrink_blocks(std::vector<extent_t> &ext, uint32_t nblks);
+  void map_range(const std::vector<extent_t> &ext, uint32_t first,
+                 uint32_t nblks, std::vector<extent_t> &runs);
+  void write_blocks(const std::vector<extent_t> &ext, unsigned int off,
+                    const char *buf, unsigned int n, unsigned int old_size);
 
  public:
   inode_manager();
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
-  void write_file(uint32_t inum, const char *buf, int size);
+  int write_file(uint32_t inum, const char *buf, int size);
+  void read_range(uint32_t inum, unsigned int off, unsigned int n,
+                  char **buf, int *size);
+  int write_range(uint32_t inum, unsigned int off, const char *buf, int size);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  void statfs(extent_protocol::fsstat &st);
+  void sync();
 };
 
 #endif
@@ -37,6 +37,38 @@
 extent_client *ec;
 int total_score = 0;
 
+// write_range straight to the server, past the extent cache: a
+// compound of that one op
+extent_protocol::status server_write(extent_protocol::extentid_t id,
+                                     unsigned int off, const std::string &data)
+{
+    std::vector<extent_protocol::op> ops(1);
+    std::vector<extent_protocol::result> res;
+    ops[0].type = extent_protocol::write_range;
+    ops[0].id = id;
+    ops[0].off = off;
+    ops[0].n = 0;
+    ops[0].data = data;
+    return ec->compound(ops, res);
+}
+
+// get straight from the server, past the extent cache
+extent_protocol::status server_get(extent_protocol::extentid_t id,
+                                   std::string &buf)
+{
+    std::vector<extent_protocol::op> ops(1);
+    std::vector<extent_protocol::result> res;
+    ops[0].type = extent_protocol::get;
+    ops[0].id = id;
+    ops[0].off = 0;
+    ops[0].n = 0;
+    extent_protocol::status ret = ec->compound(ops, res);
+    if (ret == extent_protocol::OK)
+        buf = res[0].data;
+    return ret;
+}
+
+
 int test_create_and_getattr()
 {
     int i, rnum;
@@ -224,6 +256,388 @@ int test_remove()
     return 0;
 }
 
+// Unscored: fill the disk up to its last block, then free it again.
+int test_full_disk()
+{
+    extent_protocol::extentid_t id;
+    extent_protocol::fsstat before, full, after;
+
+    printf("begin test full disk\n");
+    if (ec->statfs(before) != extent_protocol::OK) {
+        iprint("error statfs, return not OK\n");
+        return 1;
+    }
+    ec->create(extent_protocol::T_FILE, id);
+    std::string buf((before.bfree + 64) * before.bsize, 'x');
+    // the cache may take the put; the server refuses it at write-back
+    extent_protocol::status ret = ec->put(id, buf);
+    if (ret == extent_protocol::OK)
+        ret = ec->flush(id);
+    if (ret != extent_protocol::NOSPC) {
+        iprint("error filling the disk, no NOSPC\n");
+        return 2;
+    }
+    if (ec->flush(id) != extent_protocol::OK) {
+        iprint("error flush, NOSPC reported twice\n");
+        return 2;
+    }
+    ec->statfs(full);
+    if (full.bfree != 0) {
+        iprint("error filling the disk, blocks left free\n");
+        return 2;
+    }
+    std::string buf_2, buf_3;
+    if (ec->get(id, buf_2) != extent_protocol::OK ||
+        buf_2.size() > buf.size() || buf.compare(0, buf_2.size(), buf_2) != 0) {
+        iprint("error get, not a prefix of the put on a full disk\n");
+        return 3;
+    }
+    if (server_get(id, buf_3) != extent_protocol::OK || buf_3 != buf_2) {
+        iprint("error get, the cache kept data the server refused\n");
+        return 3;
+    }
+    ec->remove(id);
+    ec->statfs(after);
+    if (after.bfree != before.bfree) {
+        iprint("error removing, blocks of the full disk not freed\n");
+        return 4;
+    }
+    printf("end test full disk\n");
+    return 0;
+}
+
+extent_protocol::op make_op(uint32_t type, extent_protocol::extentid_t id,
+                            unsigned int off, const std::string &data)
+{
+    extent_protocol::op o;
+    o.type = type;
+    o.id = id;
+    o.off = off;
+    o.n = type == extent_protocol::create ? extent_protocol::T_FILE : 0;
+    o.data = data;
+    return o;
+}
+
+extent_protocol::extentid_t pair_ids[2];
+bool pair_torn;
+
+// writes its digit to both extents of pair_ids in one compound, in the
+// order given by arg
+void *pair_writer(void *arg)
+{
+    long first = (long)arg;
+    std::string d(4096, '0' + first);
+    for (int i = 0; i < 2000; i++) {
+        std::vector<extent_protocol::op> ops;
+        std::vector<extent_protocol::result> res;
+        ops.push_back(make_op(extent_protocol::write_range, pair_ids[first], 0, d));
+        ops.push_back(make_op(extent_protocol::write_range, pair_ids[!first], 0, d));
+        ec->compound(ops, res);
+    }
+    return NULL;
+}
+
+// reads both extents of pair_ids in one compound; they must match
+void *pair_reader(void *)
+{
+    for (int i = 0; i < 2000; i++) {
+        std::vector<extent_protocol::op> ops;
+        std::vector<extent_protocol::result> res;
+        ops.push_back(make_op(extent_protocol::get, pair_ids[0], 0, ""));
+        ops.push_back(make_op(extent_protocol::get, pair_ids[1], 0, ""));
+        if (ec->compound(ops, res) != extent_protocol::OK ||
+            res[0].data != res[1].data)
+            pair_torn = true;
+    }
+    return NULL;
+}
+
+int test_compound()
+{
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::result> res;
+
+    printf("begin test compound\n");
+    // id 0 stands for the extent the create made
+    ops.push_back(make_op(extent_protocol::create, 0, 0, ""));
+    ops.push_back(make_op(extent_protocol::write_range, 0, 10, "hello"));
+    ops.push_back(make_op(extent_protocol::getattr, 0, 0, ""));
+    ops.push_back(make_op(extent_protocol::get, 0, 0, ""));
+    if (ec->compound(ops, res) != extent_protocol::OK || res.size() != 4 ||
+        res[0].id == 0 || res[2].a.type != extent_protocol::T_FILE ||
+        res[2].a.size != 15 || res[3].data != std::string(10, '\0') + "hello") {
+        iprint("error compound, results not those of the ops\n");
+        return 1;
+    }
+    extent_protocol::extentid_t id = res[0].id;
+
+    // it stops at the first op that fails; those before it stay done
+    ops.clear();
+    ops.push_back(make_op(extent_protocol::write_range, id, 0, "HELLO"));
+    ops.push_back(make_op(extent_protocol::write_range, id,
+                          extent_protocol::MAXSIZE, "x"));
+    ops.push_back(make_op(extent_protocol::remove, id, 0, ""));
+    std::string buf;
+    if (ec->compound(ops, res) != extent_protocol::FBIG || res.size() != 2 ||
+        res[0].ret != extent_protocol::OK || res[1].ret != extent_protocol::FBIG ||
+        ec->get(id, buf) != extent_protocol::OK ||
+        buf != "HELLO" + std::string(5, '\0') + "hello") {
+        iprint("error compound, a failed op not where it stopped\n");
+        return 2;
+    }
+    ec->remove(id);
+
+    // compounds on the same extents, in either order, neither deadlock
+    // nor interleave
+    ec->create(extent_protocol::T_FILE, pair_ids[0]);
+    ec->create(extent_protocol::T_FILE, pair_ids[1]);
+    pair_torn = false;
+    pthread_t th[3];
+    pthread_create(&th[0], NULL, pair_writer, (void *)0);
+    pthread_create(&th[1], NULL, pair_writer, (void *)1);
+    pthread_create(&th[2], NULL, pair_reader, NULL);
+    for (int i = 0; i < 3; i++)
+        pthread_join(th[i], NULL);
+    ec->remove(pair_ids[0]);
+    ec->remove(pair_ids[1]);
+    if (pair_torn) {
+        iprint("error compound, another compound seen halfway\n");
+        return 3;
+    }
+    printf("end test compound\n");
+    return 0;
+}
+
+// what a compound sends and gets back over RPC with YFS_CHECKSUM set
+int test_compound_checksum()
+{
+    std::vector<extent_protocol::op> ops, got;
+    std::string data(3000, 'w');
+
+    printf("begin test compound checksum\n");
+    ops.push_back(make_op(extent_protocol::write_range, 5, 100, data));
+    ops.push_back(make_op(extent_protocol::get, 0, 0, ""));
+    marshall m;
+    m << extent_protocol::checked_ops(ops);
+    std::string wire = m.get_content();
+    unmarshall u(wire);
+    u >> got;
+    if (!u.okdone() || got.size() != 2 || got[0].data != data ||
+        got[0].id != (5 | extent_protocol::CHECKSUM) ||
+        got[1].id != extent_protocol::CHECKSUM) {
+        iprint("error compound, checksummed ops not those sent\n");
+        return 1;
+    }
+    wire[wire.size() - 1000] ^= 1;
+    unmarshall bad(wire);
+    bad >> got;
+    if (bad.ok()) {
+        iprint("error compound, a changed op taken\n");
+        return 2;
+    }
+
+    extent_protocol::result r;
+    r.ret = extent_protocol::OK;
+    r.id = 0;
+    memset(&r.a, 0, sizeof(r.a));
+    r.data = data;
+    r.crc = true;
+    marshall m2;
+    m2 << r;
+    wire = m2.get_content();
+    extent_protocol::result back;
+    unmarshall u2(wire);
+    u2 >> back;
+    if (!u2.okdone() || back.ret != extent_protocol::OK || back.data != data) {
+        iprint("error compound, checksummed result not the one sent\n");
+        return 3;
+    }
+    wire[wire.size() - 1000] ^= 1;
+    unmarshall u3(wire);
+    u3 >> back;
+    if (!u3.okdone() || back.ret != extent_protocol::IOERR) {
+        iprint("error compound, a changed result not an IOERR\n");
+        return 4;
+    }
+    printf("end test compound checksum\n");
+    return 0;
+}
+
+unsigned long long writebacks()
+{
+    unsigned long long n = 0;
+    std::string s = ec->cache_stats();
+    const char *p = strstr(s.c_str(), "writebacks ");
+    if (p)
+        sscanf(p, "writebacks %llu", &n);
+    return n;
+}
+
+int test_cache_writeback()
+{
+    extent_protocol::extentid_t id;
+    std::string want(300, '\0'), buf;
+
+    printf("begin test cache write-back\n");
+    ec->create(extent_protocol::T_FILE, id);
+    // overlapping and disjoint ranges, with a hole between them
+    ec->write_range(id, 0, std::string(50, 'a'));
+    ec->write_range(id, 20, std::string(50, 'b'));
+    ec->write_range(id, 200, std::string(100, 'c'));
+    want.replace(0, 20, std::string(20, 'a'));
+    want.replace(20, 50, std::string(50, 'b'));
+    want.replace(200, 100, std::string(100, 'c'));
+    if (ec->get(id, buf) != extent_protocol::OK || buf != want) {
+        iprint("error get, cached writes not seen\n");
+        return 1;
+    }
+    unsigned long long n = writebacks();
+    if (ec->flush(id) != extent_protocol::OK) {
+        iprint("error flush, return not OK\n");
+        return 2;
+    }
+    if (ec->flush(id) != extent_protocol::OK || writebacks() > n + 1) {
+        iprint("error flush, clean extent written back\n");
+        return 3;
+    }
+    if (server_get(id, buf) != extent_protocol::OK || buf != want) {
+        iprint("error get, the server's copy is not what was written\n");
+        return 4;
+    }
+    ec->remove(id);
+    printf("end test cache write-back\n");
+    return 0;
+}
+
+int test_far_write_full_disk()
+{
+    extent_protocol::extentid_t hole, id, far;
+    extent_protocol::fsstat before, st, after;
+
+    printf("begin test far write on a full disk\n");
+    ec->statfs(before);
+    // a file to free later, and one filling the rest of the disk
+    ec->create(extent_protocol::T_FILE, hole);
+    server_write(hole, 0, std::string(64 * before.bsize, 'h'));
+    ec->create(extent_protocol::T_FILE, id);
+    server_write(id, 0, std::string(before.bfree * before.bsize, 'x'));
+    ec->remove(hole);
+    ec->statfs(st);
+    if (st.bfree < 64) {
+        iprint("error removing, blocks not freed\n");
+        return 1;
+    }
+
+    // the gap up to the write takes every free block, and is not enough
+    ec->create(extent_protocol::T_FILE, far);
+    if (server_write(far, (st.bfree + 16) * st.bsize, "z") !=
+        extent_protocol::NOSPC) {
+        iprint("error write_range, no NOSPC on a full disk\n");
+        return 2;
+    }
+    ec->statfs(after);
+    if (after.bfree != st.bfree) {
+        iprint("error write_range, blocks of a failed write not freed\n");
+        return 3;
+    }
+    if (server_write(far, 0, "y") != extent_protocol::OK) {
+        iprint("error write_range after a failed one, return not OK\n");
+        return 4;
+    }
+    std::string buf;
+    if (ec->get(far, buf) != extent_protocol::OK || buf != "y") {
+        iprint("error get after a failed write_range\n");
+        return 5;
+    }
+    ec->remove(far);
+    ec->remove(id);
+    ec->statfs(after);
+    if (after.bfree != before.bfree) {
+        iprint("error removing, blocks of the full disk not freed\n");
+        return 6;
+    }
+    printf("end test far write on a full disk\n");
+    return 0;
+}
+
+// a block of data that tells file f's block i from any other
+std::string frag_block(int f, int i, unsigned int bsize)
+{
+    std::string b(bsize, 'a' + (i + f) % 26);
+    b[0] = '0' + f;
+    b[1] = i & 0x7f;
+    b[2] = (i >> 7) & 0x7f;
+    return b;
+}
+
+int test_fragmented()
+{
+    extent_protocol::extentid_t id[2];
+    extent_protocol::fsstat before, after;
+    std::string want[2], buf;
+
+    printf("begin test fragmented files\n");
+    ec->statfs(before);
+    // grown side by side a block at a time, each file takes runs of a
+    // few blocks: well past the direct extents, into the extent blocks
+    // under the double indirect one
+    ec->create(extent_protocol::T_FILE, id[0]);
+    ec->create(extent_protocol::T_FILE, id[1]);
+    for (int i = 0; i < 1500; i++) {
+        for (int f = 0; f < 2; f++) {
+            std::string b = frag_block(f, i, before.bsize);
+            if (server_write(id[f], want[f].size(), b) != extent_protocol::OK) {
+                iprint("error write_range, return not OK\n");
+                return 1;
+            }
+            want[f] += b;
+        }
+    }
+    for (int f = 0; f < 2; f++) {
+        if (server_get(id[f], buf) != extent_protocol::OK || buf != want[f]) {
+            iprint("error get, a fragmented file not what was written\n");
+            return 2;
+        }
+    }
+
+    // ranges across extents, then the file cut back to its first
+    // extents and grown again
+    std::vector<extent_protocol::op> ops(1);
+    std::vector<extent_protocol::result> res;
+    ops[0] = make_op(extent_protocol::read_range, id[0], 700 * before.bsize - 3, "");
+    ops[0].n = 100 * before.bsize;
+    if (ec->compound(ops, res) != extent_protocol::OK ||
+        res[0].data != want[0].substr(700 * before.bsize - 3, 100 * before.bsize)) {
+        iprint("error read_range across extents\n");
+        return 3;
+    }
+    ops[0] = make_op(extent_protocol::put, id[0], 0, want[0].substr(0, 5 * before.bsize));
+    if (ec->compound(ops, res) != extent_protocol::OK ||
+        server_get(id[0], buf) != extent_protocol::OK ||
+        buf != want[0].substr(0, 5 * before.bsize)) {
+        iprint("error put, a fragmented file not cut back\n");
+        return 4;
+    }
+    ops[0] = make_op(extent_protocol::put, id[0], 0, want[0]);
+    if (ec->compound(ops, res) != extent_protocol::OK ||
+        server_get(id[0], buf) != extent_protocol::OK || buf != want[0] ||
+        server_get(id[1], buf) != extent_protocol::OK || buf != want[1]) {
+        iprint("error put, a fragmented file not grown back\n");
+        return 5;
+    }
+
+    // its extent blocks go with it
+    ec->remove(id[0]);
+    ec->remove(id[1]);
+    ec->statfs(after);
+    if (after.bfree != before.bfree) {
+        iprint("error removing, blocks of fragmented files not freed\n");
+        return 6;
+    }
+    printf("end test fragmented files\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -239,6 +653,12 @@ int main(int argc, char *argv[])
         goto test_finish;
     if (test_remove() != 0)
         goto test_finish;
+    test_compound();
+    test_compound_checksum();
+    test_fragmented();
+    test_cache_writeback();
+    test_full_disk();
+    test_far_write_full_disk();
 
 test_finish:
     printf("---------------------------------\n");
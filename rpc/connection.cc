@@ -0,0 +1,550 @@
+// connection and tcpsconn, the byte streams under rpcc and rpcs.
+//
+// rpc.o in librpc.a reaches them only through the out-of-line methods
+// below and connect_to_dst(), and allocates nothing but tcpsconn, whose
+// layout is unchanged; so this takes the place of the library's
+// connection.o.
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <algorithm>
+
+#include "method_thread.h"
+#include "connection.h"
+#include "slock.h"
+#include "pollmgr.h"
+#include "marshall.h"
+#include "rpc_stats.h"
+#include "jsl_log.h"
+#include "lang/verify.h"
+
+#define MAX_PDU (10<<20) //maximum PDF is 10M
+#define ACCEPT_BACKOFF 100000 // us to wait after accept() runs out of fds
+#define SENT_SLOTS 4096 // recent requests remembered to spot retransmits
+
+// The clt_nonce and xid of requests sent lately, by hash. rpcc sends a
+// request again under the same xid when its reply is late, maybe on a
+// new connection, so all connections share this.
+static uint64_t sent_[SENT_SLOTS];
+
+// count b, a request, as a retransmit if it was sent before
+static void
+note_request(const char *b, int sz)
+{
+	int at = sizeof(rpc_sz_t);
+#if RPC_CHECKSUMMING
+	at += sizeof(rpc_checksum_t);
+#endif
+	if (sz < at + (int)sizeof(req_header))
+		return;
+	uint32_t xid, nonce;
+	memcpy(&xid, b + at, sizeof(xid));
+	memcpy(&nonce, b + at + offsetof(req_header, clt_nonce), sizeof(nonce));
+	uint64_t key = (uint64_t)nonce << 32 | xid;
+	uint64_t *slot = &sent_[((key * 0x9e3779b97f4a7c15ULL) >> 32) % SENT_SLOTS];
+	if (__atomic_exchange_n(slot, key, __ATOMIC_RELAXED) == key)
+		rpc_stat_count(RPC_STAT_RETRANSMIT);
+}
+
+connection::connection(chanmgr *m1, int f1, int l1)
+: mgr_(m1), fd_(f1), dead_(false), writer_(false), polled_(false),
+	in_write_(false), rhdr_n_(0), client_(false), refno_(1), lossy_(l1)
+{
+	int flags = fcntl(fd_, F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(fd_, F_SETFL, flags);
+
+	signal(SIGPIPE, SIG_IGN);
+	VERIFY(pthread_mutex_init(&m_,0)==0);
+	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
+	VERIFY(pthread_cond_init(&send_complete_,0)==0);
+
+	VERIFY(gettimeofday(&create_time_, NULL) == 0);
+
+	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
+}
+
+connection::~connection()
+{
+	VERIFY(dead_);
+	VERIFY(pthread_mutex_destroy(&m_)== 0);
+	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
+	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
+	if (rpdu_.buf)
+		free(rpdu_.buf);
+	VERIFY(wq_.empty());
+	close(fd_);
+}
+
+void
+connection::incref()
+{
+	ScopedLock ml(&ref_m_);
+	refno_++;
+}
+
+bool
+connection::isdead()
+{
+	ScopedLock ml(&m_);
+	return dead_;
+}
+
+void
+connection::closeconn()
+{
+	{
+		ScopedLock ml(&m_);
+		if (!dead_) {
+			dead_ = true;
+			shutdown(fd_,SHUT_RDWR);
+			VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+		}else{
+			return;
+		}
+	}
+	//after block_remove_fd, select will never wait on fd_
+	//and no callbacks will be active
+	PollMgr::Instance()->block_remove_fd(fd_);
+}
+
+void
+connection::decref()
+{
+	{
+		ScopedLock rl(&ref_m_);
+		refno_ --;
+		VERIFY(refno_>=0);
+		if (refno_ > 0)
+			return;
+	}
+	// nobody is left holding a reference to take another from
+	bool dead;
+	{
+		ScopedLock ml(&m_);
+		dead = dead_;
+	}
+	if (dead)
+		delete this;
+}
+
+int
+connection::ref()
+{
+	ScopedLock rl(&ref_m_);
+	return refno_;
+}
+
+int
+connection::compare(connection *another)
+{
+        if (create_time_.tv_sec > another->create_time_.tv_sec)
+                return 1;
+        if (create_time_.tv_sec < another->create_time_.tv_sec)
+                return -1;
+        if (create_time_.tv_usec > another->create_time_.tv_usec)
+                return 1;
+        if (create_time_.tv_usec < another->create_time_.tv_usec)
+                return -1;
+        return 0;
+}
+
+bool
+connection::send(char *b, int sz)
+{
+	if (client_)
+		note_request(b, sz);
+
+	ScopedLock ml(&m_);
+	if (dead_)
+		return false;
+
+	// a kept reply, sent again for a duplicate, may be in another
+	// sendmsg() right now; it has its length already
+	int sz1 = htonl(sz);
+	if (memcmp(b, &sz1, sizeof(sz1)) != 0)
+		bcopy(&sz1, b, sizeof(sz1));
+	charbuf w(b, sz);
+	wq_.push_back(&w);
+
+	if (lossy_) {
+		if ((random()%100) < lossy_) {
+			jsl_log(JSL_DBG_1, "connection::send LOSSY TEST shutdown fd_ %d\n", fd_);
+			shutdown(fd_,SHUT_RDWR);
+		}
+	}
+
+	while (!dead_ && w.solong < w.sz) {
+		if (writer_) {
+			VERIFY(pthread_cond_wait(&send_complete_, &m_) == 0);
+			continue;
+		}
+		writer_ = true;
+		if (!writepdus(true)) {
+			dead_ = true;
+			writer_ = false;
+			VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			PollMgr::Instance()->block_remove_fd(fd_);
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			break;
+		}
+		if (!wq_.empty()) {
+			//the socket is full
+			polled_ = true;
+			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
+		} else {
+			writer_ = false;
+		}
+		VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+	}
+
+	bool ret = w.solong == w.sz;
+	if (!ret) {
+		// the writer may still be handing w to sendmsg()
+		while (in_write_)
+			VERIFY(pthread_cond_wait(&send_complete_, &m_) == 0);
+		std::deque<charbuf *>::iterator i = std::find(wq_.begin(), wq_.end(), &w);
+		if (i != wq_.end())
+			wq_.erase(i);
+	}
+	return ret;
+}
+
+//fd_ is ready to be written
+void
+connection::write_cb(int s)
+{
+	ScopedLock ml(&m_);
+	VERIFY(fd_ == s);
+	if (dead_ || !polled_)
+		return;
+	if (!writepdus(false)) {
+		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
+		dead_ = true;
+	} else if (!wq_.empty()) {
+		VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+		return;
+	} else {
+		PollMgr::Instance()->del_callback(fd_, CB_WRONLY);
+	}
+	writer_ = polled_ = false;
+	VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+}
+
+//fd_ is ready to be read
+void
+connection::read_cb(int s)
+{
+	char *b = NULL;
+	int sz = 0;
+	{
+		ScopedLock ml(&m_);
+		VERIFY(fd_ == s);
+		if (dead_)  {
+			return;
+		}
+
+		bool succ = true;
+		if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
+			succ = readpdu();
+		}
+
+		if (!succ) {
+			PollMgr::Instance()->del_callback(fd_,CB_RDWR);
+			dead_ = true;
+			VERIFY(pthread_cond_broadcast(&send_complete_) == 0);
+		}
+
+		if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
+			b = rpdu_.buf;
+			sz = rpdu_.sz;
+		}
+	}
+
+	// without m_, so that sends on this connection go on meanwhile
+	if (b && mgr_->got_pdu(this, b, sz)) {
+		//chanmgr has successfully consumed the pdu
+		rpdu_.buf = NULL;
+		rpdu_.sz = rpdu_.solong = 0;
+	}
+}
+
+// Writes the queued pdus until wq_ is empty or the socket is full; a
+// written pdu leaves wq_. Only the writer calls it, with m_ held; with
+// unlock, m_ is released during sendmsg() so that more pdus can queue.
+// Returns false on a write error, or if the connection died meanwhile.
+bool
+connection::writepdus(bool unlock)
+{
+	while (!wq_.empty()) {
+		struct iovec iov[CONN_IOV_MAX];
+		int n = 0;
+		ssize_t want = 0;
+		for (; n < CONN_IOV_MAX && n < (int)wq_.size(); n++) {
+			charbuf *p = wq_[n];
+			VERIFY(p->solong >= 0 && p->solong < p->sz);
+			iov[n].iov_base = p->buf + p->solong;
+			iov[n].iov_len = p->sz - p->solong;
+			want += iov[n].iov_len;
+		}
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		// cork if this sendmsg() leaves pdus behind
+		int flags = MSG_NOSIGNAL | (n < (int)wq_.size() ? MSG_MORE : 0);
+
+		if (unlock) {
+			in_write_ = true;
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+		}
+		ssize_t done = sendmsg(fd_, &msg, flags);
+		int err = errno;
+		if (unlock) {
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			in_write_ = false;
+			if (dead_)
+				return false;
+		}
+
+		if (done < 0) {
+			if (err == EINTR)
+				continue;
+			if (err == EAGAIN || err == EWOULDBLOCK)
+				return true;
+			jsl_log(JSL_DBG_1, "connection::writepdus fd_ %d failure errno=%d\n", fd_, err);
+			return false;
+		}
+
+		for (ssize_t left = done; left > 0; ) {
+			charbuf *p = wq_.front();
+			if (left < p->sz - p->solong) {
+				p->solong += left;
+				break;
+			}
+			left -= p->sz - p->solong;
+			p->solong = p->sz;
+			wq_.pop_front();
+		}
+		if (done < want)
+			return true;
+	}
+	return true;
+}
+
+bool
+connection::readpdu()
+{
+	if (!rpdu_.sz) {
+		// a pdu may start anywhere in what the peer sent at once, so
+		// its header too can come in pieces
+		int sz, sz1;
+		int n = read(fd_, rhdr_ + rhdr_n_, sizeof(rhdr_) - rhdr_n_);
+
+		if (n == 0) {
+			return false;
+		}
+
+		if (n < 0) {
+			return errno == EAGAIN;
+		}
+
+		rhdr_n_ += n;
+		if (rhdr_n_ < (int)sizeof(rhdr_)) {
+			return true;
+		}
+		rhdr_n_ = 0;
+		memcpy(&sz1, rhdr_, sizeof(sz1));
+
+		sz = ntohl(sz1);
+
+		if (sz > MAX_PDU) {
+			char *tmpb = (char *)&sz1;
+			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz,
+					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
+			return false;
+		}
+
+		rpdu_.sz = sz;
+		VERIFY(rpdu_.buf == NULL);
+		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
+		VERIFY(rpdu_.buf);
+		bcopy(&sz1,rpdu_.buf,sizeof(sz));
+		rpdu_.solong = sizeof(sz);
+	}
+
+	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
+	if (n <= 0) {
+		// errno is stale at end of file
+		if (n < 0 && errno == EAGAIN)
+			return true;
+		if (rpdu_.buf)
+			free(rpdu_.buf);
+		rpdu_.buf = NULL;
+		rpdu_.sz = rpdu_.solong = 0;
+		return false;
+	}
+	rpdu_.solong += n;
+	return true;
+}
+
+tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
+: mgr_(m1), lossy_(lossytest)
+{
+	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+
+	tcp_ = socket(AF_INET, SOCK_STREAM, 0);
+	if(tcp_ < 0){
+		perror("tcpsconn::tcpsconn accept_loop socket:");
+		VERIFY(0);
+	}
+
+	int yes = 1;
+	setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
+		perror("accept_loop tcp bind:");
+		VERIFY(0);
+	}
+
+	if(listen(tcp_, 1000) < 0) {
+		perror("tcpsconn::tcpsconn listen:");
+		VERIFY(0);
+	}
+
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port,
+		sin.sin_port);
+
+	if (pipe(pipe_) < 0) {
+		perror("accept_loop pipe:");
+		VERIFY(0);
+	}
+
+	int flags = fcntl(pipe_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipe_[0], F_SETFL, flags);
+
+	VERIFY((th_ = method_thread(this, false, &tcpsconn::accept_conn)) != 0);
+}
+
+tcpsconn::~tcpsconn()
+{
+	VERIFY(close(pipe_[1]) == 0);
+	VERIFY(pthread_join(th_, NULL) == 0);
+
+	//close all the active connections
+	std::map<int, connection *>::iterator i;
+	for (i = conns_.begin(); i != conns_.end(); i++) {
+		i->second->closeconn();
+		i->second->decref();
+	}
+}
+
+void
+tcpsconn::process_accept()
+{
+	// garbage collect all dead connections with refcount of 1, first,
+	// so that their fds are free for accept()
+	std::map<int, connection *>::iterator i;
+	for (i = conns_.begin(); i != conns_.end();) {
+		if (i->second->isdead() && i->second->ref() == 1) {
+			jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
+					i->second->channo());
+			i->second->decref();
+			conns_.erase(i++);
+		} else
+			++i;
+	}
+
+	sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	int s1 = accept(tcp_, (sockaddr *)&sin, &slen);
+	if (s1 < 0) {
+		// the connection stays queued when out of fds or memory; wait
+		// for some to be freed rather than spin on it
+		int e = errno;
+		jsl_log(JSL_DBG_OFF, "tcpsconn::accept_conn error errno %d\n", e);
+		if (e == EMFILE || e == ENFILE || e == ENOBUFS || e == ENOMEM)
+			usleep(ACCEPT_BACKOFF);
+		return;
+	}
+
+	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n",
+			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+	connection *ch = new connection(mgr_, s1, lossy_);
+	conns_[ch->channo()] = ch;
+}
+
+void
+tcpsconn::accept_conn()
+{
+	fd_set rfds;
+	int max_fd = pipe_[0] > tcp_ ? pipe_[0] : tcp_;
+
+	while (1) {
+		FD_ZERO(&rfds);
+		FD_SET(pipe_[0], &rfds);
+		FD_SET(tcp_, &rfds);
+
+		int ret = select(max_fd+1, &rfds, NULL, NULL, NULL);
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else {
+				perror("accept_conn select:");
+				jsl_log(JSL_DBG_OFF, "tcpsconn::accept_conn failure errno %d\n",errno);
+				VERIFY(0);
+			}
+		}
+
+		if (FD_ISSET(pipe_[0], &rfds)) {
+			close(pipe_[0]);
+			close(tcp_);
+			return;
+		}
+		else if (FD_ISSET(tcp_, &rfds)) {
+			process_accept();
+		} else {
+			VERIFY(0);
+		}
+	}
+}
+
+connection *
+connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
+{
+	int s= socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
+		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s:%d\n",
+				inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+		close(s);
+		return NULL;
+	}
+	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
+			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+	connection *c = new connection(mgr, s, lossy);
+	c->client_ = true;
+	return c;
+}
@@ -7,6 +7,7 @@
 #include <netinet/in.h>
 #include <cstddef>
 
+#include <deque>
 #include <map>
 
 #include "pollmgr.h"
@@ -19,6 +20,12 @@ class chanmgr {
 		virtual ~chanmgr() {}
 };
 
+#define CONN_IOV_MAX 64  // pdus written by one sendmsg()
+
+// Concurrent send()s on a connection queue their pdus. Whichever sender
+// finds nobody writing writes the queue, its own pdu and those queued
+// behind it, with one sendmsg() per CONN_IOV_MAX pdus; when the socket
+// is full, write_cb() carries on. A sender returns once its pdu is out.
 class connection : public aio_callback {
 	public:
 		struct charbuf {
@@ -46,27 +53,34 @@ class connection : public aio_callback {
                 
                 int compare(connection *another);
 	private:
+		friend connection *connect_to_dst(const sockaddr_in &dst,
+				chanmgr *mgr, int lossy);
 
 		bool readpdu();
-		bool writepdu();
+		bool writepdus(bool unlock);
 
+		// librpc.a's rpc.o inlines channo(), so fd_ stays where it was
 		chanmgr *mgr_;
 		const int fd_;
 		bool dead_;
 
-		charbuf wpdu_;
-		charbuf rpdu_;
+		std::deque<charbuf *> wq_;  // pdus of waiting senders, oldest first
+		bool writer_;    // someone is writing wq_
+		bool polled_;    // and it is write_cb()
+		bool in_write_;  // and it is in sendmsg() without m_
+		charbuf rpdu_;  // only the poll thread reads it
+		char rhdr_[sizeof(int)];  // the length of the next pdu,
+		int rhdr_n_;              // rhdr_n_ bytes of it read so far
+		bool client_;  // made by connect_to_dst(), sends requests
                 
                 struct timeval create_time_;
 
-		int waiters_;
 		int refno_;
 		const int lossy_;
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
 		pthread_cond_t send_complete_;
-		pthread_cond_t send_wait_;
 };
 
 class tcpsconn {
@@ -0,0 +1,109 @@
+// CRC32C, in hardware when possible.
+
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#define CRC32C_POLY  0x82f63b78  // reversed Castagnoli polynomial
+#define CRC32C_CHUNK 4096        // crc32c_copy() sums each chunk while cached
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void
+make_table()
+{
+	for (int i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (int i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++)
+			table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+	}
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+	pthread_once(&table_once, make_table);
+	for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;  // little-endian: crc covers the low four bytes
+		crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+			table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+			table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+			table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+	}
+#endif
+	for (; n > 0; n--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+	for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	uint64_t c = crc;
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	crc = (uint32_t)c;
+	for (; n > 0; n--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+
+static bool
+have_hw()
+{
+	static bool hw = __builtin_cpu_supports("sse4.2");
+	return hw;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (have_hw())
+		return ~crc32c_hw(crc, p, n);
+#endif
+	return ~crc32c_sw(crc, p, n);
+}
+
+uint32_t
+crc32c_tables(uint32_t crc, const void *buf, size_t n)
+{
+	return ~crc32c_sw(~crc, (const unsigned char *)buf, n);
+}
+
+uint32_t
+crc32c_copy(uint32_t crc, void *dst, const void *src, size_t n)
+{
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+	while (n > 0) {
+		size_t c = n < CRC32C_CHUNK ? n : CRC32C_CHUNK;
+		memcpy(d, s, c);
+		crc = crc32c(crc, d, c);
+		d += c;
+		s += c;
+		n -= c;
+	}
+	return crc;
+}
@@ -0,0 +1,20 @@
+#ifndef crc32c_h
+#define crc32c_h
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU
+// has it, and slicing-by-8 tables otherwise.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Extend crc, the CRC32C of some bytes (0 for none), with n more.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
+
+// memcpy() that also extends crc with the bytes copied, reading them
+// once from memory.
+uint32_t crc32c_copy(uint32_t crc, void *dst, const void *src, size_t n);
+
+// crc32c() by the slicing-by-8 tables, whatever the CPU.
+uint32_t crc32c_tables(uint32_t crc, const void *buf, size_t n);
+
+#endif
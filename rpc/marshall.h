@@ -12,6 +12,7 @@
 #include <inttypes.h>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
+#include "crc32c.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -68,6 +69,26 @@ class marshall {
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
 
+		// Append n bytes preceded by their CRC32C (4 bytes, most
+		// significant first), summed as they are copied in.
+		void rawbytes_crc(const char *p, int n) {
+			reserve(4 + n);
+			uint32_t crc = crc32c_copy(0, _buf + _ind + 4, p, n);
+			for (int i = 0; i < 4; i++)
+				_buf[_ind + i] = (char)(crc >> (24 - 8 * i));
+			_ind += 4 + n;
+		}
+
+		// Make room for n more bytes with at most one reallocation,
+		// rather than doubling (and copying) as rawbytes() goes.
+		void reserve(int n) {
+			if (_ind + n > _capa) {
+				_capa = _ind + n;
+				_buf = (char *) realloc(_buf, _capa);
+				VERIFY(_buf);
+			}
+		}
+
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
@@ -162,6 +183,20 @@ class unmarshall {
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
 
+		// Like rawbytes() but leaves the n bytes where they are and
+		// returns a pointer to them, valid as long as this object.
+		const char *rawbytes_ref(unsigned int n) {
+			if (!_ok || n > (unsigned int)(_sz - _ind)) {
+				_ok = false;
+				return NULL;
+			}
+			const char *p = _buf + _ind;
+			_ind += n;
+			return p;
+		}
+
+		void set_bad() { _ok = false; }
+
 		int ind() { return _ind;}
 		int size() { return _sz;}
 		void unpack(int *); //non-const ref
@@ -208,6 +243,126 @@ unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
 
+// A byte string with the wire format of std::string, marshalled without
+// the intermediate copies. A request argument points straight into the
+// request buffer, which lives until the handler returns; an outgoing one
+// points at the caller's memory and is copied once into the message.
+//
+// With crc set it goes out with a CRC32C of its bytes: the length word
+// is RPC_BYTES_CRC, a length no byte string in a pdu can have, and the
+// real length and the CRC follow. The CRC is checked on the way in (crc
+// then says whether there was one).
+#define RPC_BYTES_CRC 0xffffffffu
+
+struct rpc_bytes {
+	rpc_bytes(): data(NULL), len(0), crc(false) {}
+	rpc_bytes(const char *d, unsigned int l, bool c = false)
+		: data(d), len(l), crc(c) {}
+	rpc_bytes(const std::string &s, bool c = false)
+		: data(s.data()), len(s.size()), crc(c) {}
+	const char *data;
+	unsigned int len;
+	bool crc;
+};
+
+// A reply byte string in a malloc()ed buffer the handler hands over,
+// e.g. straight from the storage layer, freed once marshalled.
+struct rpc_buf {
+	rpc_buf(): data(NULL), len(0), crc(false) {}
+	~rpc_buf() { free(data); }
+	char *data;
+	unsigned int len;
+	bool crc;
+	private:
+	rpc_buf(const rpc_buf &);
+	rpc_buf &operator=(const rpc_buf &);
+};
+
+// A reply byte string received into s, CRC checked if it has one. A
+// mismatch sets corrupt rather than failing the unmarshall, which
+// rpcc::call treats as a protocol bug.
+struct rpc_string {
+	rpc_string(std::string &str): s(str), corrupt(false) {}
+	std::string &s;
+	bool corrupt;
+};
+
+inline marshall &
+operator<<(marshall &m, const rpc_bytes &b)
+{
+	if (b.crc) {
+		m.reserve(2 * sizeof(unsigned int) + 4 + b.len);
+		m << RPC_BYTES_CRC;
+		m << b.len;
+		m.rawbytes_crc(b.data, b.len);
+		return m;
+	}
+	m.reserve(sizeof(unsigned int) + b.len);
+	m << b.len;
+	m.rawbytes(b.data, b.len);
+	return m;
+}
+
+// Read the length, and the CRC if there is one; false if the CRC is
+// missing.
+inline bool
+unmarshall_bytes_head(unmarshall &u, unsigned int *len, bool *has_crc,
+		uint32_t *crc)
+{
+	u >> *len;
+	*has_crc = *len == RPC_BYTES_CRC;
+	if (!*has_crc)
+		return true;
+	u >> *len;
+	const unsigned char *p = (const unsigned char *)u.rawbytes_ref(4);
+	if (p == NULL)
+		return false;
+	*crc = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+	return true;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, rpc_bytes &b)
+{
+	uint32_t crc = 0;
+	if (!unmarshall_bytes_head(u, &b.len, &b.crc, &crc) ||
+			(b.data = u.rawbytes_ref(b.len)) == NULL) {
+		b.data = NULL;
+		b.len = 0;
+		return u;
+	}
+	if (b.crc && crc32c(0, b.data, b.len) != crc)
+		u.set_bad();
+	return u;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, rpc_string &r)
+{
+	unsigned int len;
+	bool has_crc;
+	uint32_t crc = 0;
+	const char *p;
+	if (!unmarshall_bytes_head(u, &len, &has_crc, &crc) ||
+			(p = u.rawbytes_ref(len)) == NULL)
+		return u;
+	r.s.resize(len);
+	if (!has_crc) {
+		if (len)
+			memcpy(&r.s[0], p, len);
+		return u;
+	}
+	r.corrupt = (len ? crc32c_copy(0, &r.s[0], p, len) : 0) != crc;
+	return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const rpc_buf &b)
+{
+	return m << rpc_bytes(b.data, b.len, b.crc);
+}
+
 template <class C> marshall &
 operator<<(marshall &m, std::vector<C> v)
 {
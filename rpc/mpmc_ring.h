@@ -0,0 +1,101 @@
+#ifndef mpmc_ring_h
+#define mpmc_ring_h
+
+// bounded multi-producer multi-consumer queue, without locks
+// (D. Vyukov's): every cell carries a sequence number that says whether
+// it is the turn of an enq or of a deq at that position. enq() and
+// deq() never block, they fail when the ring is FULL or EMPTY.
+
+#include <stdlib.h>
+#include "lang/verify.h"
+
+template<class T>
+class mpmc_ring {
+	public:
+		mpmc_ring(unsigned int size); // a power of two
+		~mpmc_ring();
+		bool enq(const T &e);
+		bool deq(T *e);
+
+	private:
+		enum { CACHE_LINE = 64 };
+		struct cell {
+			unsigned long seq;
+			T e;
+		};
+
+		cell *cells_;
+		unsigned long mask_;
+		// producers and consumers each hammer their own line
+		char pad0_[CACHE_LINE];
+		unsigned long head_; // next position to enq at
+		char pad1_[CACHE_LINE];
+		unsigned long tail_; // next position to deq from
+		char pad2_[CACHE_LINE];
+
+		mpmc_ring(const mpmc_ring &);
+		mpmc_ring &operator=(const mpmc_ring &);
+};
+
+template<class T>
+mpmc_ring<T>::mpmc_ring(unsigned int size) : mask_(size - 1), head_(0), tail_(0)
+{
+	VERIFY(size >= 2 && (size & (size - 1)) == 0);
+	cells_ = new cell[size];
+	for (unsigned long i = 0; i < size; i++)
+		cells_[i].seq = i;
+}
+
+template<class T>
+mpmc_ring<T>::~mpmc_ring()
+{
+	delete[] cells_;
+}
+
+template<class T> bool
+mpmc_ring<T>::enq(const T &e)
+{
+	unsigned long pos = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+	while (1) {
+		cell *c = &cells_[pos & mask_];
+		unsigned long seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&head_, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				c->e = e;
+				__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (dif < 0) {
+			return false;  // the cell still holds an old element
+		} else {
+			pos = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+template<class T> bool
+mpmc_ring<T>::deq(T *e)
+{
+	unsigned long pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+	while (1) {
+		cell *c = &cells_[pos & mask_];
+		unsigned long seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&tail_, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*e = c->e;
+				__atomic_store_n(&c->seq, pos + mask_ + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (dif < 0) {
+			return false;  // nothing enq'ed at this position yet
+		} else {
+			pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+#endif
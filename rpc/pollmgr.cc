@@ -0,0 +1,331 @@
+// PollMgr, the event loop under connection.
+//
+// connection.o in librpc.a reaches it only through Instance(),
+// add_callback(), del_callback() and block_remove_fd(), so this takes
+// the place of the library's pollmgr.o, whose tables stopped at 128 fds
+// and whose one thread served every connection.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "pollmgr.h"
+#include "slock.h"
+#include "jsl_log.h"
+#include "method_thread.h"
+#include "lang/verify.h"
+
+PollMgr *PollMgr::instance = NULL;
+static pthread_once_t pollmgr_is_initialized = PTHREAD_ONCE_INIT;
+
+void
+PollMgrInit()
+{
+	PollMgr::instance = new PollMgr();
+}
+
+PollMgr *
+PollMgr::Instance()
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	return instance;
+}
+
+PollMgr::PollMgr()
+{
+	char *env = getenv("RPC_POLL_THREADS");
+	int n = env ? atoi(env) : POLL_THREADS;
+	if (n < 1)
+		n = 1;
+	for (int i = 0; i < n; i++)
+		reactors_.push_back(new PollReactor());
+}
+
+PollMgr::~PollMgr()
+{
+	//never kill me!!!
+	VERIFY(0);
+}
+
+PollReactor *
+PollMgr::reactor_of(int fd)
+{
+	VERIFY(fd >= 0);
+	return reactors_[fd % reactors_.size()];
+}
+
+void
+PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
+{
+	reactor_of(fd)->add_callback(fd, flag, ch);
+}
+
+void
+PollMgr::del_callback(int fd, poll_flag flag)
+{
+	reactor_of(fd)->del_callback(fd, flag);
+}
+
+bool
+PollMgr::has_callback(int fd, poll_flag flag, aio_callback *ch)
+{
+	return reactor_of(fd)->has_callback(fd, flag, ch);
+}
+
+//remove all callbacks related to fd
+//the return guarantees that callbacks related to fd
+//will never be called again
+void
+PollMgr::block_remove_fd(int fd)
+{
+	reactor_of(fd)->block_remove_fd(fd);
+}
+
+PollReactor::PollReactor() : pending_change_(false), changes_done_(0)
+{
+	aio_ = new EPollAIO();
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
+	VERIFY((th_ = method_thread(this, false, &PollReactor::wait_loop)) != 0);
+}
+
+PollReactor::~PollReactor()
+{
+	//never kill me!!!
+	VERIFY(0);
+}
+
+void
+PollReactor::add_callback(int fd, poll_flag flag, aio_callback *ch)
+{
+	ScopedLock ml(&m_);
+	if ((unsigned int)fd >= callbacks_.size())
+		callbacks_.resize(fd + 1, NULL);
+	aio_->watch_fd(fd, flag);
+
+	VERIFY(!callbacks_[fd] || callbacks_[fd] == ch);
+	callbacks_[fd] = ch;
+}
+
+void
+PollReactor::del_callback(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	if (aio_->unwatch_fd(fd, flag) && (unsigned int)fd < callbacks_.size())
+		callbacks_[fd] = NULL;
+}
+
+bool
+PollReactor::has_callback(int fd, poll_flag flag, aio_callback *ch)
+{
+	ScopedLock ml(&m_);
+	if ((unsigned int)fd >= callbacks_.size() || callbacks_[fd] != ch)
+		return false;
+	return aio_->is_watched(fd, flag);
+}
+
+// Waits until wait_loop() has finished the callbacks it started before
+// fd was unwatched. On the reactor's own thread, which is between
+// callbacks, there is nothing to wait for.
+void
+PollReactor::block_remove_fd(int fd)
+{
+	ScopedLock ml(&m_);
+	aio_->unwatch_fd(fd, CB_RDWR);
+	if (!pthread_equal(pthread_self(), th_)) {
+		pending_change_ = true;
+		aio_->wake();
+		unsigned long done = changes_done_;
+		while (changes_done_ == done)
+			VERIFY(pthread_cond_wait(&changedone_c_, &m_) == 0);
+	}
+	if ((unsigned int)fd < callbacks_.size())
+		callbacks_[fd] = NULL;
+}
+
+aio_callback *
+PollReactor::callback_of(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	if ((unsigned int)fd >= callbacks_.size() || !aio_->is_watched(fd, flag))
+		return NULL;
+	return callbacks_[fd];
+}
+
+// Calls read_cb() while fd has input, at most POLL_BATCH times, and
+// returns whether input is left. Each call must find input: connection
+// reads a pdu's header expecting it to be there.
+bool
+PollReactor::drain(int fd)
+{
+	for (int i = 0; i < POLL_BATCH; i++) {
+		char c;
+		int n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return false;
+		aio_callback *cb = callback_of(fd, CB_RDONLY);
+		if (!cb)
+			return false;
+		cb->read_cb(fd);
+		if (n <= 0)
+			return false;  // end of file or an error, read_cb() has seen it
+	}
+	return true;
+}
+
+void
+PollReactor::wait_loop()
+{
+	std::vector<int> readable;
+	std::vector<int> writable;
+	std::vector<int> backlog;  // fds whose batch ran out with input left
+	std::vector<int> left;
+	std::vector<char> in_left;  // indexed by fd
+
+	while (1) {
+		{
+			ScopedLock ml(&m_);
+			if (pending_change_) {
+				pending_change_ = false;
+				changes_done_++;
+				VERIFY(pthread_cond_broadcast(&changedone_c_) == 0);
+			}
+		}
+		readable.clear();
+		writable.clear();
+		aio_->wait_ready(&readable, &writable, backlog.empty() ? -1 : 0);
+
+		// an fd reported again while in the backlog is drained once
+		left.clear();
+		for (unsigned int i = 0; i < backlog.size(); i++)
+			in_left[backlog[i]] = 0;
+		for (unsigned int i = 0; i < backlog.size() + readable.size(); i++) {
+			int fd = i < backlog.size() ? backlog[i]
+			    : readable[i - backlog.size()];
+			if ((unsigned int)fd < in_left.size() && in_left[fd])
+				continue;
+			if (drain(fd)) {
+				if ((unsigned int)fd >= in_left.size())
+					in_left.resize(fd + 1, 0);
+				in_left[fd] = 1;
+				left.push_back(fd);
+			}
+		}
+		backlog.swap(left);
+
+		for (unsigned int i = 0; i < writable.size(); i++) {
+			int fd = writable[i];
+			aio_callback *cb = callback_of(fd, CB_WRONLY);
+			if (cb)
+				cb->write_cb(fd);
+		}
+	}
+}
+
+EPollAIO::EPollAIO()
+{
+	pollfd_ = epoll_create(POLL_EVENTS);
+	VERIFY(pollfd_ >= 0);
+	VERIFY(pipe(pipefd_) == 0);
+	VERIFY(fcntl(pipefd_[0], F_SETFL, O_NONBLOCK) == 0);
+	VERIFY(fcntl(pipefd_[1], F_SETFL, O_NONBLOCK) == 0);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = pipefd_[0];
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
+}
+
+EPollAIO::~EPollAIO()
+{
+	close(pollfd_);
+	close(pipefd_[0]);
+	close(pipefd_[1]);
+}
+
+static inline int
+poll_flag_to_event(int flag)
+{
+	int f = EPOLLET;
+	if (flag & CB_RDONLY)
+		f |= EPOLLIN | EPOLLRDHUP;
+	if (flag & CB_WRONLY)
+		f |= EPOLLOUT;
+	return f;
+}
+
+void
+EPollAIO::watch_fd(int fd, poll_flag flag)
+{
+	VERIFY(fd >= 0);
+	if ((unsigned int)fd >= fdstatus_.size())
+		fdstatus_.resize(fd + 1, CB_NONE);
+	int op = fdstatus_[fd] == CB_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	fdstatus_[fd] |= flag;
+
+	struct epoll_event ev;
+	ev.events = poll_flag_to_event(fdstatus_[fd]);
+	ev.data.fd = fd;
+	if (epoll_ctl(pollfd_, op, fd, &ev) != 0) {
+		// fd was closed while watched, and epoll forgot it
+		VERIFY(op == EPOLL_CTL_MOD && errno == ENOENT);
+		VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, fd, &ev) == 0);
+	}
+}
+
+bool
+EPollAIO::unwatch_fd(int fd, poll_flag flag)
+{
+	if (fd < 0 || (unsigned int)fd >= fdstatus_.size()
+	    || fdstatus_[fd] == CB_NONE)
+		return true;
+	fdstatus_[fd] &= ~flag;
+
+	struct epoll_event ev;
+	ev.events = poll_flag_to_event(fdstatus_[fd]);
+	ev.data.fd = fd;
+	int op = fdstatus_[fd] == CB_NONE ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	// fails only if fd was closed while watched, which epoll forgets
+	if (epoll_ctl(pollfd_, op, fd, &ev) != 0)
+		jsl_log(JSL_DBG_4, "EPollAIO::unwatch_fd %d: %s\n", fd,
+		    strerror(errno));
+	return fdstatus_[fd] == CB_NONE;
+}
+
+bool
+EPollAIO::is_watched(int fd, poll_flag flag)
+{
+	if (fd < 0 || (unsigned int)fd >= fdstatus_.size())
+		return false;
+	return (fdstatus_[fd] & flag) == flag;
+}
+
+void
+EPollAIO::wake()
+{
+	char c = 1;
+	// a full pipe has a wakeup pending already
+	(void) write(pipefd_[1], &c, sizeof(c));
+}
+
+void
+EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable, int timeout)
+{
+	int nfds = epoll_wait(pollfd_, ready_, POLL_EVENTS, timeout);
+	for (int i = 0; i < nfds; i++) {
+		int fd = ready_[i].data.fd;
+		if (fd == pipefd_[0]) {
+			char buf[64];
+			while (read(pipefd_[0], buf, sizeof(buf)) > 0)
+				;
+			continue;
+		}
+		if (ready_[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			readable->push_back(fd);
+		if (ready_[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			writable->push_back(fd);
+	}
+}
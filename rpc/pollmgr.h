@@ -1,14 +1,14 @@
 #ifndef pollmgr_h
-#define pollmgr_h 
+#define pollmgr_h
 
-#include <sys/select.h>
+#include <pthread.h>
 #include <vector>
 
-#ifdef __linux__
 #include <sys/epoll.h>
-#endif
 
-#define MAX_POLL_FDS 128
+#define POLL_THREADS 4   // default for the RPC_POLL_THREADS env var
+#define POLL_BATCH   16  // read_cb()s per fd before other fds get a turn
+#define POLL_EVENTS  256 // events taken from epoll at once
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -23,7 +23,10 @@ class aio_mgr {
 		virtual void watch_fd(int fd, poll_flag flag) = 0;
 		virtual bool unwatch_fd(int fd, poll_flag flag) = 0;
 		virtual bool is_watched(int fd, poll_flag flag) = 0;
-		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable) = 0;
+		// with timeout 0, returns at once
+		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable, int timeout) = 0;
+		// makes a wait_ready() in progress return
+		virtual void wake() = 0;
 		virtual ~aio_mgr() {}
 };
 
@@ -34,58 +37,60 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
+class PollReactor;
+
+// Runs read_cb()/write_cb() of the aio_callbacks watching fds. The fds
+// are sharded over RPC_POLL_THREADS reactors, each with its own thread
+// and epoll instance; the tables grow with the highest fd.
 class PollMgr {
 	public:
 		PollMgr();
 		~PollMgr();
 
 		static PollMgr *Instance();
-		static PollMgr *CreateInst();
 
 		void add_callback(int fd, poll_flag flag, aio_callback *ch);
 		void del_callback(int fd, poll_flag flag);
 		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
 		void block_remove_fd(int fd);
-		void wait_loop();
-
 
 		static PollMgr *instance;
-		static int useful;
-		static int useless;
 
 	private:
-		pthread_mutex_t m_;
-		pthread_cond_t changedone_c_;
-		pthread_t th_;
-
-		aio_callback *callbacks_[MAX_POLL_FDS];
-		aio_mgr *aio_;
-		bool pending_change_;
+		std::vector<PollReactor *> reactors_;
 
+		PollReactor *reactor_of(int fd);
 };
 
-class SelectAIO : public aio_mgr {
-	public :
+// One thread waiting on one aio_mgr, and the callbacks of its fds.
+class PollReactor {
+	public:
+		PollReactor();
+		~PollReactor();
 
-		SelectAIO();
-		~SelectAIO();
-		void watch_fd(int fd, poll_flag flag);
-		bool unwatch_fd(int fd, poll_flag flag);
-		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void add_callback(int fd, poll_flag flag, aio_callback *ch);
+		void del_callback(int fd, poll_flag flag);
+		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
+		void block_remove_fd(int fd);
+		void wait_loop();
 
 	private:
-
-		fd_set rfds_;
-		fd_set wfds_;
-		int highfds_;
-		int pipefd_[2];
-
 		pthread_mutex_t m_;
+		pthread_cond_t changedone_c_;
+		pthread_t th_;
+
+		std::vector<aio_callback *> callbacks_;  // indexed by fd
+		aio_mgr *aio_;
+		bool pending_change_;
+		unsigned long changes_done_;
 
+		aio_callback *callback_of(int fd, poll_flag flag);
+		bool drain(int fd);
 };
 
-#ifdef __linux__ 
+// Edge-triggered epoll: an fd is reported once each time it becomes
+// ready, so its reader must drain it (see PollReactor::drain()).
+// Callers serialize watch_fd(), unwatch_fd() and is_watched().
 class EPollAIO : public aio_mgr {
 	public:
 		EPollAIO();
@@ -93,15 +98,14 @@ class EPollAIO : public aio_mgr {
 		void watch_fd(int fd, poll_flag flag);
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
-		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable, int timeout);
+		void wake();
 
 	private:
 		int pollfd_;
-		struct epoll_event ready_[MAX_POLL_FDS];
-		int fdstatus_[MAX_POLL_FDS];
-
+		int pipefd_[2];
+		struct epoll_event ready_[POLL_EVENTS];
+		std::vector<int> fdstatus_;  // indexed by fd
 };
-#endif /* __linux */
 
 #endif /* pollmgr_h */
-
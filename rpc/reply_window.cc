@@ -0,0 +1,421 @@
+// The at-most-once reply window of rpcs.
+//
+// Each client gets a ring of slots indexed by xid modulo its size,
+// holding the xids the client has sent but not yet acknowledged
+// (acked < xid <= acked + size). Finding a duplicate is one index,
+// acknowledging replies walks only the slots being freed. Clients are
+// spread over RPC_REPLY_SHARDS locks, so dispatch threads working for
+// different clients do not contend.
+//
+// A ring grows no further than RPC_REPLY_MAX_SLOTS: a client whose xids
+// run further ahead of its acknowledgements has its oldest replies
+// forgotten, as if acknowledged, and their duplicates get FORGOTTEN. A
+// window nothing has come through for RPC_REPLY_IDLE seconds is thrown
+// away; that is far longer than rpcc retransmits a request.
+//
+// rpcs::dispatch() sends a kept reply after checkduplicate_and_update()
+// or add_reply() has returned, so the window may not free it then. Each
+// dispatch thread holds a reference to the reply it sends until it
+// takes its next request; a reply is freed when the window and every
+// such thread have let go of it.
+//
+// The rpcs layout is fixed by librpc.a, so the windows are kept here,
+// keyed by server and client nonce, rather than in rpcs::reply_window_.
+
+#include <map>
+#include <set>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include "rpc.h"
+#include "slock.h"
+#include "jsl_log.h"
+#include "rpc_stats.h"
+
+#define RPC_REPLY_SHARDS   16
+#define RPC_REPLY_SLOTS    16            // initial ring size, a power of two
+#define RPC_REPLY_MAX_SLOTS 4096         // largest ring size, a power of two
+#define RPC_REPLY_CAP      (64 << 20)    // default for the RPC_REPLY_CAP env var
+#define RPC_REPLY_IDLE     600           // default for the RPC_REPLY_IDLE env var, seconds
+
+__thread int rpcs_running_proc = -1;
+
+namespace {
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_INPROGRESS,
+	SLOT_DONE,
+	SLOT_DROPPED,  // done, but the reply was not kept
+};
+
+struct shard;
+
+struct reply_buf {
+	char *buf;
+	int sz;
+	int refs;   // the window's and the dispatch threads'
+	shard *sh;  // whose lock guards refs
+};
+
+struct slot {
+	unsigned int xid;
+	slot_state state;
+	reply_buf *rep;  // if SLOT_DONE
+};
+
+struct client_window {
+	unsigned int acked;  // replies up to this xid are forgotten
+	std::vector<slot> slots;
+	time_t last;         // when a request or reply last came through
+
+	client_window() : acked(0), slots(RPC_REPLY_SLOTS), last(time(NULL)) {
+		clear_all();
+	}
+	void clear_all() {
+		for (unsigned int i = 0; i < slots.size(); i++) {
+			slots[i].state = SLOT_FREE;
+			slots[i].rep = NULL;
+		}
+	}
+	slot *find(unsigned int xid) {
+		slot *s = &slots[xid & (slots.size() - 1)];
+		return s->state != SLOT_FREE && s->xid == xid ? s : NULL;
+	}
+};
+
+struct shard {
+	pthread_mutex_t m;
+	std::map<std::pair<const rpcs *, unsigned int>, client_window *> clients;
+	time_t swept;  // when idle windows were last looked for
+
+	shard() : swept(0) { VERIFY(pthread_mutex_init(&m, 0) == 0); }
+};
+
+shard shards[RPC_REPLY_SHARDS];
+long stored_bytes;  // reply bytes kept in all windows
+
+std::set<std::pair<const rpcs *, unsigned int> > idempotent_procs;
+pthread_mutex_t idempotent_m = PTHREAD_MUTEX_INITIALIZER;
+
+// the replies a dispatch thread may still be sending
+pthread_key_t held_key;
+pthread_once_t held_once = PTHREAD_ONCE_INIT;
+
+shard &
+shard_of(unsigned int clt_nonce)
+{
+	return shards[clt_nonce % RPC_REPLY_SHARDS];
+}
+
+long
+read_reply_cap()
+{
+	char *env = getenv("RPC_REPLY_CAP");
+	return env ? atol(env) : RPC_REPLY_CAP;
+}
+
+long
+reply_cap()
+{
+	static long cap = read_reply_cap();
+	return cap;
+}
+
+long
+read_reply_idle()
+{
+	char *env = getenv("RPC_REPLY_IDLE");
+	return env ? atol(env) : RPC_REPLY_IDLE;
+}
+
+long
+reply_idle()
+{
+	static long idle = read_reply_idle();
+	return idle;
+}
+
+// with r->sh->m held
+void
+unref(reply_buf *r)
+{
+	if (--r->refs > 0)
+		return;
+	free(r->buf);
+	delete r;
+}
+
+void
+release_held(void *v)
+{
+	std::vector<reply_buf *> *held = (std::vector<reply_buf *> *)v;
+	for (unsigned int i = 0; i < held->size(); i++) {
+		reply_buf *r = (*held)[i];
+		ScopedLock rwl(&r->sh->m);
+		unref(r);
+	}
+	held->clear();
+}
+
+void
+free_held(void *v)
+{
+	release_held(v);
+	delete (std::vector<reply_buf *> *)v;
+}
+
+void
+make_held_key()
+{
+	VERIFY(pthread_key_create(&held_key, free_held) == 0);
+}
+
+std::vector<reply_buf *> *
+held_replies()
+{
+	pthread_once(&held_once, make_held_key);
+	std::vector<reply_buf *> *held =
+		(std::vector<reply_buf *> *)pthread_getspecific(held_key);
+	if (held == NULL) {
+		held = new std::vector<reply_buf *>();
+		VERIFY(pthread_setspecific(held_key, held) == 0);
+	}
+	return held;
+}
+
+// The calling thread is about to send r; with r->sh->m held.
+void
+hold(reply_buf *r)
+{
+	r->refs++;
+	held_replies()->push_back(r);
+}
+
+bool
+is_idempotent(const rpcs *srv, int proc)
+{
+	if (proc < 0)
+		return false;
+	ScopedLock il(&idempotent_m);
+	return idempotent_procs.count(std::make_pair(srv, (unsigned int)proc)) > 0;
+}
+
+void
+forget(slot *s)
+{
+	if (s->state == SLOT_DONE) {
+		__atomic_sub_fetch(&stored_bytes, s->rep->sz, __ATOMIC_RELAXED);
+		unref(s->rep);
+	}
+	s->state = SLOT_FREE;
+	s->rep = NULL;
+}
+
+// Forget every reply up to xid_rep, which the client has received.
+void
+ack(client_window *w, unsigned int xid_rep)
+{
+	if ((int)(xid_rep - w->acked) <= 0)
+		return;
+	if (xid_rep - w->acked >= w->slots.size()) {
+		for (unsigned int i = 0; i < w->slots.size(); i++) {
+			slot *s = &w->slots[i];
+			if (s->state != SLOT_FREE && (int)(s->xid - xid_rep) <= 0)
+				forget(s);
+		}
+	} else {
+		for (unsigned int x = w->acked + 1; x != xid_rep + 1; x++) {
+			slot *s = w->find(x);
+			if (s)
+				forget(s);
+		}
+	}
+	w->acked = xid_rep;
+}
+
+// Make the ring big enough for xid, keeping the slots in use; past
+// RPC_REPLY_MAX_SLOTS, forget the oldest instead.
+void
+grow(client_window *w, unsigned int xid)
+{
+	if (xid - w->acked > RPC_REPLY_MAX_SLOTS)
+		ack(w, xid - RPC_REPLY_MAX_SLOTS);
+	unsigned int n = w->slots.size();
+	while (xid - w->acked > n)
+		n *= 2;
+	if (n == w->slots.size())
+		return;
+
+	std::vector<slot> old;
+	old.swap(w->slots);
+	w->slots.resize(n);
+	w->clear_all();
+	for (unsigned int i = 0; i < old.size(); i++) {
+		if (old[i].state != SLOT_FREE)
+			w->slots[old[i].xid & (n - 1)] = old[i];
+	}
+}
+
+void
+free_window(client_window *w)
+{
+	for (unsigned int i = 0; i < w->slots.size(); i++)
+		forget(&w->slots[i]);
+	delete w;
+}
+
+// Throw away the windows of sh idle since before now - reply_idle(),
+// at most once a second; with sh.m held.
+void
+sweep(shard &sh, time_t now)
+{
+	if (now == sh.swept)
+		return;
+	sh.swept = now;
+	std::map<std::pair<const rpcs *, unsigned int>, client_window *>::iterator it =
+		sh.clients.begin();
+	while (it != sh.clients.end()) {
+		if (now - it->second->last < reply_idle()) {
+			++it;
+			continue;
+		}
+		jsl_log(JSL_DBG_2, "rpcs: forgetting idle client %u\n", it->first.second);
+		free_window(it->second);
+		sh.clients.erase(it++);
+	}
+}
+
+}
+
+void
+rpcs::set_idempotent(unsigned int proc)
+{
+	ScopedLock il(&idempotent_m);
+	idempotent_procs.insert(std::make_pair((const rpcs *)this, proc));
+}
+
+// A request from clt_nonce with xid arrived; say whether it is new, or
+// a duplicate of one in progress, answered (*b, *sz get the reply, which
+// stays owned by the window) or forgotten. A new xid is recorded as in
+// progress. xid_rep acknowledges replies, which are then forgotten.
+// The calling thread has sent the replies it held.
+rpcs::rpcstate_t
+rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
+		unsigned int xid_rep, char **b, int *sz)
+{
+	release_held(held_replies());
+	rpcs_running_proc = -1;
+
+	shard &sh = shard_of(clt_nonce);
+	ScopedLock rwl(&sh.m);
+	time_t now = time(NULL);
+	sweep(sh, now);
+
+	client_window *&w = sh.clients[std::make_pair((const rpcs *)this, clt_nonce)];
+	if (w == NULL)
+		w = new client_window();
+	w->last = now;
+	ack(w, xid_rep);
+
+	if ((int)(xid - w->acked) <= 0) {
+		rpc_stat_count(RPC_STAT_FORGOTTEN);
+		return FORGOTTEN;
+	}
+
+	slot *s = w->find(xid);
+	if (s && s->state == SLOT_INPROGRESS) {
+		rpc_stat_count(RPC_STAT_DUP_INPROGRESS);
+		return INPROGRESS;
+	}
+	if (s && s->state == SLOT_DONE) {
+		rpc_stat_count(RPC_STAT_DUP_DONE);
+		hold(s->rep);
+		*b = s->rep->buf;
+		*sz = s->rep->sz;
+		return DONE;
+	}
+
+	// new, or answered before with a reply that was not kept: run it
+	if (!s) {
+		grow(w, xid);
+		s = &w->slots[xid & (w->slots.size() - 1)];
+		s->xid = xid;
+	}
+	s->state = SLOT_INPROGRESS;
+	s->rep = NULL;
+	return NEW;
+}
+
+// The reply b (sz bytes) to xid from clt_nonce is about to be sent; the
+// window takes it over. Past the memory cap the reply of an idempotent
+// procedure (see set_idempotent()) is not kept, and a duplicate request
+// will be run again.
+void
+rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz)
+{
+	bool keep = __atomic_load_n(&stored_bytes, __ATOMIC_RELAXED) + sz <= reply_cap()
+		|| !is_idempotent(this, rpcs_running_proc);
+
+	shard &sh = shard_of(clt_nonce);
+	ScopedLock rwl(&sh.m);
+
+	std::map<std::pair<const rpcs *, unsigned int>, client_window *>::iterator it =
+		sh.clients.find(std::make_pair((const rpcs *)this, clt_nonce));
+	slot *s = NULL;
+	if (it != sh.clients.end()) {
+		it->second->last = time(NULL);
+		s = it->second->find(xid);
+	}
+
+	reply_buf *r = new reply_buf;
+	r->buf = b;
+	r->sz = sz;
+	r->refs = 0;
+	r->sh = &sh;
+	hold(r);
+
+	if (!s || !keep) {
+		if (s) {
+			s->state = SLOT_DROPPED;
+			rpc_stat_count(RPC_STAT_REPLY_DROPPED);
+		}
+		jsl_log(JSL_DBG_4, "rpcs::add_reply: not keeping %d bytes for xid %u\n",
+				sz, xid);
+		return;
+	}
+
+	// the length a send would put there, before another thread can
+	// send it too (see connection::send())
+	int sz1 = htonl(sz);
+	memcpy(b, &sz1, sizeof(sz1));
+	__atomic_add_fetch(&stored_bytes, sz, __ATOMIC_RELAXED);
+	r->refs++;
+	s->state = SLOT_DONE;
+	s->rep = r;
+}
+
+void
+rpcs::free_reply_window(void)
+{
+	for (int i = 0; i < RPC_REPLY_SHARDS; i++) {
+		shard &sh = shards[i];
+		ScopedLock rwl(&sh.m);
+		std::map<std::pair<const rpcs *, unsigned int>, client_window *>::iterator it =
+			sh.clients.begin();
+		while (it != sh.clients.end()) {
+			if (it->first.first != this) {
+				++it;
+				continue;
+			}
+			free_window(it->second);
+			sh.clients.erase(it++);
+		}
+	}
+
+	ScopedLock il(&idempotent_m);
+	std::set<std::pair<const rpcs *, unsigned int> >::iterator p =
+		idempotent_procs.lower_bound(std::make_pair((const rpcs *)this, 0U));
+	while (p != idempotent_procs.end() && p->first == this)
+		idempotent_procs.erase(p++);
+}
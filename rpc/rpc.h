@@ -10,6 +10,7 @@
 #include "thr_pool.h"
 #include "marshall.h"
 #include "connection.h"
+#include "rpc_stats.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -27,6 +28,8 @@ class rpc_const {
 		static const int cancel_failure = -7;
 };
 
+class rpc_future;
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
@@ -98,6 +101,11 @@ class rpcc : public chanmgr {
 
 		void set_reachable(bool r) { reachable_ = r; }
 
+	// Replies to proc may be left out of the reply window when it is
+	// over its memory cap, and a duplicate request run again; only for
+	// procedures that can safely run twice. Other replies are always kept.
+	void set_idempotent(unsigned int proc);
+
 		void cancel();
                 
                 int islossy() { return lossytest_ > 0; }
@@ -138,13 +146,29 @@ class rpcc : public chanmgr {
 						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
 						R & r, TO to = to_max); 
 
+		// Like call(), but returns as soon as the request is handed
+		// to a thread of the async pool; f.get() waits for the reply.
+		// Calls issued this way are outstanding together, each under
+		// its own xid on the one connection.
+		template<class A1>
+			void call_async(unsigned int proc, const A1 & a1, rpc_future &f,
+					TO to = to_max);
+		template<class A1, class A2>
+			void call_async(unsigned int proc, const A1 & a1, const A2 & a2,
+					rpc_future &f, TO to = to_max);
+		template<class A1, class A2, class A3>
+			void call_async(unsigned int proc, const A1 & a1, const A2 & a2,
+					const A3 & a3, rpc_future &f, TO to = to_max);
 };
 
 template<class R> int 
 rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to) 
 {
 	unmarshall u;
+	uint64_t t0 = rpc_stat_now();
 	int intret = call1(proc, req, u, to);
+	rpc_stat_record(RPC_STAT_CLIENT, proc, rpc_stat_now() - t0, req.size(),
+			u.size());
 	if (intret < 0) return intret;
 	u >> r;
 	if(u.okdone() != true) {
@@ -252,6 +276,114 @@ rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
 	return call_m(proc, m, r, to);
 }
 
+// threads issuing the calls started by rpcc::call_async()
+#define RPC_ASYNC_THREADS 16
+
+// The reply of an rpcc::call_async(). Not copyable, and used for one
+// call only; destroying it waits for the call to finish.
+class rpc_future {
+	public:
+		rpc_future() : cl_(NULL), intret_(0), pending_(false) {
+			VERIFY(pthread_mutex_init(&m_, 0) == 0);
+			VERIFY(pthread_cond_init(&c_, 0) == 0);
+		}
+		~rpc_future() {
+			wait();
+			VERIFY(pthread_mutex_destroy(&m_) == 0);
+			VERIFY(pthread_cond_destroy(&c_) == 0);
+		}
+
+		// wait for the reply and unmarshall it into r, returns what
+		// rpcc::call() would have
+		template<class R> int get(R & r);
+
+	private:
+		friend class rpcc;
+
+		rpcc *cl_;
+		unsigned int proc_;
+		rpcc::TO to_;
+		marshall req_;
+		unmarshall rep_;
+		int intret_;
+		bool pending_;
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+
+		static LFThrPool *pool() {
+			static LFThrPool *p = new LFThrPool(RPC_ASYNC_THREADS);
+			return p;
+		}
+
+		void start(rpcc *cl, unsigned int proc, rpcc::TO to) {
+			VERIFY(!pending_);
+			cl_ = cl;
+			proc_ = proc;
+			to_ = to;
+			pending_ = true;
+			VERIFY(pool()->addObjJob(this, &rpc_future::run, 0));
+		}
+
+		void run(int) {
+			uint64_t t0 = rpc_stat_now();
+			int ret = cl_->call1(proc_, req_, rep_, to_);
+			rpc_stat_record(RPC_STAT_CLIENT, proc_, rpc_stat_now() - t0,
+					req_.size(), rep_.size());
+			pthread_mutex_lock(&m_);
+			intret_ = ret;
+			pending_ = false;
+			pthread_cond_broadcast(&c_);
+			pthread_mutex_unlock(&m_);
+		}
+
+		void wait() {
+			pthread_mutex_lock(&m_);
+			while (pending_)
+				pthread_cond_wait(&c_, &m_);
+			pthread_mutex_unlock(&m_);
+		}
+
+		rpc_future(const rpc_future &);
+		rpc_future &operator=(const rpc_future &);
+};
+
+template<class R> int
+rpc_future::get(R & r)
+{
+	wait();
+	if (intret_ < 0) return intret_;
+	rep_ >> r;
+	if (rep_.okdone() != true)
+		return rpc_const::unmarshal_reply_failure;
+	return intret_;
+}
+
+template<class A1> void
+rpcc::call_async(unsigned int proc, const A1 & a1, rpc_future &f, TO to)
+{
+	f.req_ << a1;
+	f.start(this, proc, to);
+}
+
+template<class A1, class A2> void
+rpcc::call_async(unsigned int proc, const A1 & a1, const A2 & a2,
+		rpc_future &f, TO to)
+{
+	f.req_ << a1;
+	f.req_ << a2;
+	f.start(this, proc, to);
+}
+
+template<class A1, class A2, class A3> void
+rpcc::call_async(unsigned int proc, const A1 & a1, const A2 & a2,
+		const A3 & a3, rpc_future &f, TO to)
+{
+	f.req_ << a1;
+	f.req_ << a2;
+	f.req_ << a3;
+	f.start(this, proc, to);
+}
+
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
 
 class handler {
@@ -261,6 +393,28 @@ class handler {
 		virtual int fn(unmarshall &, marshall &) = 0;
 };
 
+// The procedure whose handler this thread last ran for a new request,
+// -1 if none; the reply window looks it up (see rpc/reply_window.cc).
+extern __thread int rpcs_running_proc;
+
+// Runs a registered handler and records it in the rpcs statistics.
+class stat_handler : public handler {
+	public:
+		stat_handler(unsigned int proc, handler *h) : proc_(proc), h_(h) { }
+		~stat_handler() { delete h_; }
+		int fn(unmarshall &args, marshall &ret) {
+			rpcs_running_proc = proc_;
+			uint64_t t0 = rpc_stat_now();
+			int b = h_->fn(args, ret);
+			rpc_stat_record(RPC_STAT_SERVER, proc_, rpc_stat_now() - t0,
+					ret.size(), args.size());
+			return b;
+		}
+	private:
+		unsigned int proc_;
+		handler *h_;
+};
+
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
@@ -353,6 +507,11 @@ class rpcs : public chanmgr {
 
 	void set_reachable(bool r) { reachable_ = r; }
 
+	// Replies to proc may be left out of the reply window when it is
+	// over its memory cap, and a duplicate request run again; only for
+	// procedures that can safely run twice. Other replies are always kept.
+	void set_idempotent(unsigned int proc);
+
 	bool got_pdu(connection *c, char *b, int sz);
 
 	// register a handler
@@ -405,7 +564,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 template<class S, class A1, class A2, class R> void
@@ -432,7 +591,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 template<class S, class A1, class A2, class A3, class R> void
@@ -461,7 +620,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 template<class S, class A1, class A2, class A3, class A4, class R> void
@@ -494,7 +653,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
@@ -530,7 +689,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
@@ -569,7 +728,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 template<class S, class A1, class A2, class A3, class A4, class A5, 
@@ -612,7 +771,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 				return b;
 			}
 	};
-	reg1(proc, new h1(sob, meth));
+	reg1(proc, new stat_handler(proc, new h1(sob, meth)));
 }
 
 
@@ -0,0 +1,315 @@
+// Per-thread RPC histograms and their dump.
+
+#include "rpc_stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "lang/verify.h"
+
+#define RPC_STAT_PROCS   32   // procedures tracked, per side
+#define RPC_STAT_BUCKETS 256  // covers every uint64_t
+
+namespace {
+
+struct proc_hist {
+	uint64_t count;
+	uint64_t sum;       // us
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t buckets[RPC_STAT_BUCKETS];
+};
+
+// Only the owning thread writes a table, with relaxed atomics so that a
+// dump can read it at any time. When the thread exits, its table is
+// added into exited[] and freed.
+struct thread_stats {
+	proc_hist procs[RPC_STAT_PROCS];
+	proc_hist queue;  // dispatch pool wait, in the RPC_STAT_SERVER table
+	thread_stats *next;
+};
+
+// Procedure number of each slot of proc_hist, 0 for an unused slot.
+// Shared by all threads, a slot is claimed once and never released.
+unsigned int slot_proc[RPC_STAT_SIDES][RPC_STAT_PROCS];
+uint64_t counters[RPC_STAT_COUNTERS];
+
+// tables_m guards the lists and exited[]; a dump holds it while it
+// reads the tables, so that none is freed under it.
+thread_stats *tables[RPC_STAT_SIDES];
+thread_stats exited[RPC_STAT_SIDES];
+pthread_mutex_t tables_m = PTHREAD_MUTEX_INITIALIZER;
+__thread thread_stats *my_table[RPC_STAT_SIDES];
+
+pthread_key_t exit_key;
+pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+int
+bucket_of(uint64_t v)
+{
+	if (v < 4)
+		return v;
+	int e = 63 - __builtin_clzll(v);
+	return 4 * (e - 1) + ((v >> (e - 2)) & 3);
+}
+
+uint64_t
+bucket_low(int b)
+{
+	if (b < 4)
+		return b;
+	int e = b / 4 + 1;
+	return (uint64_t)(4 + b % 4) << (e - 2);
+}
+
+int
+slot_of(rpc_stat_side side, unsigned int proc)
+{
+	unsigned int *slots = slot_proc[side];
+	for (int i = 0; i < RPC_STAT_PROCS; i++) {
+		int s = (proc + i) % RPC_STAT_PROCS;
+		unsigned int p = __atomic_load_n(&slots[s], __ATOMIC_ACQUIRE);
+		if (p == proc)
+			return s;
+		if (p == 0) {
+			unsigned int empty = 0;
+			if (__atomic_compare_exchange_n(&slots[s], &empty, proc, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || empty == proc)
+				return s;
+		}
+	}
+	return -1;
+}
+
+void
+add(uint64_t *c, uint64_t v)
+{
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v,
+			__ATOMIC_RELAXED);
+}
+
+uint64_t
+get(const uint64_t *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+void
+add_hist(proc_hist *to, const proc_hist &h)
+{
+	to->count += get(&h.count);
+	to->sum += get(&h.sum);
+	to->bytes_out += get(&h.bytes_out);
+	to->bytes_in += get(&h.bytes_in);
+	for (int b = 0; b < RPC_STAT_BUCKETS; b++)
+		to->buckets[b] += get(&h.buckets[b]);
+}
+
+void
+record(proc_hist *h, uint64_t usec, unsigned int bytes_out,
+		unsigned int bytes_in)
+{
+	add(&h->count, 1);
+	add(&h->sum, usec);
+	add(&h->bytes_out, bytes_out);
+	add(&h->bytes_in, bytes_in);
+	add(&h->buckets[bucket_of(usec)], 1);
+}
+
+// The exit_key destructor, with the exiting thread's my_table.
+void
+table_exit(void *arg)
+{
+	thread_stats **mine = (thread_stats **)arg;
+	pthread_mutex_lock(&tables_m);
+	for (int side = 0; side < RPC_STAT_SIDES; side++) {
+		thread_stats *t = mine[side];
+		if (t == NULL)
+			continue;
+		for (int s = 0; s < RPC_STAT_PROCS; s++)
+			add_hist(&exited[side].procs[s], t->procs[s]);
+		add_hist(&exited[side].queue, t->queue);
+		thread_stats **pp = &tables[side];
+		while (*pp != t)
+			pp = &(*pp)->next;
+		*pp = t->next;
+		free(t);
+		mine[side] = NULL;
+	}
+	pthread_mutex_unlock(&tables_m);
+}
+
+void
+make_exit_key()
+{
+	VERIFY(pthread_key_create(&exit_key, table_exit) == 0);
+}
+
+thread_stats *
+table_of(rpc_stat_side side)
+{
+	thread_stats *t = my_table[side];
+	if (t)
+		return t;
+	t = (thread_stats *)calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	pthread_once(&exit_key_once, make_exit_key);
+	VERIFY(pthread_setspecific(exit_key, my_table) == 0);
+	pthread_mutex_lock(&tables_m);
+	t->next = tables[side];
+	tables[side] = t;
+	pthread_mutex_unlock(&tables_m);
+	my_table[side] = t;
+	return t;
+}
+
+}
+
+uint64_t
+rpc_stat_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+rpc_stat_record(rpc_stat_side side, unsigned int proc, uint64_t usec,
+		unsigned int bytes_out, unsigned int bytes_in)
+{
+	int s = slot_of(side, proc);
+	thread_stats *t = table_of(side);
+	if (s < 0 || t == NULL)
+		return;
+	record(&t->procs[s], usec, bytes_out, bytes_in);
+}
+
+void
+rpc_stat_count(rpc_stat_counter c)
+{
+	__atomic_add_fetch(&counters[c], 1, __ATOMIC_RELAXED);
+}
+
+void
+rpc_stat_queue_wait(uint64_t usec)
+{
+	thread_stats *t = table_of(RPC_STAT_SERVER);
+	if (t != NULL)
+		record(&t->queue, usec, 0, 0);
+}
+
+// The value at quantile q (0..1) of h, the low end of its bucket.
+static uint64_t
+quantile(const proc_hist &h, double q)
+{
+	uint64_t want = (uint64_t)(q * h.count);
+	if (want >= h.count)
+		want = h.count - 1;
+	uint64_t seen = 0;
+	for (int b = 0; b < RPC_STAT_BUCKETS; b++) {
+		seen += h.buckets[b];
+		if (seen > want)
+			return bucket_low(b);
+	}
+	return 0;
+}
+
+// "mean .. p50 .. p90 .. p99 .. p999 .. max .." of h, in us
+static std::string
+latencies(const proc_hist &h)
+{
+	uint64_t max = 0;
+	for (int b = 0; b < RPC_STAT_BUCKETS; b++) {
+		if (h.buckets[b])
+			max = bucket_low(b);
+	}
+	char s[160];
+	snprintf(s, sizeof(s), "mean %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu",
+			(unsigned long long)(h.sum / h.count),
+			(unsigned long long)quantile(h, 0.5),
+			(unsigned long long)quantile(h, 0.9),
+			(unsigned long long)quantile(h, 0.99),
+			(unsigned long long)quantile(h, 0.999),
+			(unsigned long long)max);
+	return s;
+}
+
+std::string
+rpc_stats_dump()
+{
+	static const char *side_name[RPC_STAT_SIDES] = { "rpcc", "rpcs" };
+	static const char *counter_name[RPC_STAT_COUNTERS] = {
+		"dup_inprogress", "dup_done", "forgotten", "reply_dropped",
+		"retransmits"
+	};
+	std::string out;
+	char line[256];
+
+	for (int side = 0; side < RPC_STAT_SIDES; side++) {
+		for (int s = 0; s < RPC_STAT_PROCS; s++) {
+			unsigned int proc = __atomic_load_n(&slot_proc[side][s], __ATOMIC_ACQUIRE);
+			if (proc == 0)
+				continue;
+
+			proc_hist sum_h = proc_hist();
+			pthread_mutex_lock(&tables_m);
+			add_hist(&sum_h, exited[side].procs[s]);
+			for (thread_stats *t = tables[side]; t != NULL; t = t->next)
+				add_hist(&sum_h, t->procs[s]);
+			pthread_mutex_unlock(&tables_m);
+			if (sum_h.count == 0)
+				continue;
+
+			snprintf(line, sizeof(line),
+					"%s 0x%x calls %llu us %s bytes out %llu in %llu\n",
+					side_name[side], proc,
+					(unsigned long long)sum_h.count,
+					latencies(sum_h).c_str(),
+					(unsigned long long)sum_h.bytes_out,
+					(unsigned long long)sum_h.bytes_in);
+			out += line;
+		}
+	}
+
+	proc_hist queue = proc_hist();
+	pthread_mutex_lock(&tables_m);
+	add_hist(&queue, exited[RPC_STAT_SERVER].queue);
+	for (thread_stats *t = tables[RPC_STAT_SERVER]; t != NULL; t = t->next)
+		add_hist(&queue, t->queue);
+	pthread_mutex_unlock(&tables_m);
+	if (queue.count != 0) {
+		snprintf(line, sizeof(line), "rpcs queue jobs %llu us %s\n",
+				(unsigned long long)queue.count, latencies(queue).c_str());
+		out += line;
+	}
+
+	for (int c = 0; c < RPC_STAT_COUNTERS; c++) {
+		snprintf(line, sizeof(line), "%s %llu\n", counter_name[c],
+				(unsigned long long)__atomic_load_n(&counters[c], __ATOMIC_RELAXED));
+		out += line;
+	}
+	return out;
+}
+
+static void *
+dumper(void *arg)
+{
+	int secs = (int)(long)arg;
+	while (1) {
+		sleep(secs);
+		std::string s = rpc_stats_dump();
+		fwrite(s.data(), 1, s.size(), stdout);
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+void
+rpc_stats_start_dumper(int secs)
+{
+	pthread_t th;
+	if (secs > 0 && pthread_create(&th, NULL, dumper, (void *)(long)secs) == 0)
+		pthread_detach(th);
+}
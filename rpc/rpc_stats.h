@@ -0,0 +1,47 @@
+#ifndef rpc_stats_h
+#define rpc_stats_h
+
+// Per-procedure latency and traffic statistics for rpcc and rpcs.
+//
+// Every call is recorded in a histogram of the recording thread, with
+// buckets a quarter of a power of two wide (from 1us up), so recording
+// is a few relaxed increments and never takes a lock. rpc_stats_dump()
+// adds up all the threads' histograms; those of exited threads are kept
+// in one histogram per side.
+//
+// The time requests wait in rpcs' dispatch pool before a worker takes
+// them has one more histogram, kept the same way.
+
+#include <string>
+#include <stdint.h>
+
+enum rpc_stat_side {
+	RPC_STAT_CLIENT,  // rpcc: request sent to reply unmarshalled
+	RPC_STAT_SERVER,  // rpcs: handler run, arguments to reply marshalled
+	RPC_STAT_SIDES
+};
+
+enum rpc_stat_counter {
+	RPC_STAT_DUP_INPROGRESS,  // duplicate of a request being run
+	RPC_STAT_DUP_DONE,        // duplicate answered from the reply window
+	RPC_STAT_FORGOTTEN,       // duplicate whose reply was already forgotten
+	RPC_STAT_REPLY_DROPPED,   // reply not kept, over the window's memory cap
+	RPC_STAT_RETRANSMIT,      // rpcc request sent again under the same xid
+	RPC_STAT_COUNTERS
+};
+
+uint64_t rpc_stat_now();  // microseconds, monotonic
+void rpc_stat_record(rpc_stat_side side, unsigned int proc, uint64_t usec,
+		unsigned int bytes_out, unsigned int bytes_in);
+void rpc_stat_count(rpc_stat_counter c);
+void rpc_stat_queue_wait(uint64_t usec);  // a job of the dispatch pool
+
+// One line per side and procedure: calls, mean/p50/p90/p99/p999/max
+// latency in us, bytes out and in; then the dispatch pool's queue wait
+// and the counters.
+std::string rpc_stats_dump();
+
+// Print rpc_stats_dump() to stdout every secs seconds, from a thread.
+void rpc_stats_start_dumper(int secs);
+
+#endif
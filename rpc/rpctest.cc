@@ -0,0 +1,320 @@
+// Tests of the parts of the RPC library kept in this directory: the
+// at-most-once reply window of rpcs (reply_window.cc), the statistics
+// kept of it (rpc_stats.cc), and the CRC32C of byte strings (crc32c.cc,
+// rpc_bytes in marshall.h).
+//
+// ./rpc/rpctest [port]
+//
+// A raw client sends requests with xids of its choosing over a
+// connection of its own, which rpcc would not do, and sees exactly
+// which the server runs and what it answers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include "rpc.h"
+#include "connection.h"
+#include "slock.h"
+#include "rpc_stats.h"
+#include "crc32c.h"
+#include "lang/verify.h"
+
+enum { inc = 0x9001, inc_idem, inc_slow };
+
+#define REPLY_WAIT 2  // seconds to wait for a reply before giving up
+
+struct counter {
+	int n;
+	counter() : n(0) {}
+	int inc(int, int &r) {
+		r = __sync_add_and_fetch(&n, 1);
+		return 0;
+	}
+	int inc_slow(int, int &r) {
+		usleep(300 * 1000);
+		return inc(0, r);
+	}
+};
+
+class raw_client : public chanmgr {
+	private:
+		connection *c_;
+		unsigned int srv_nonce_;
+		pthread_mutex_t m_;
+		pthread_cond_t got_;
+		std::map<int, int> rets_, values_, nreplies_;  // by xid
+
+	public:
+		raw_client(int port) : srv_nonce_(0) {
+			VERIFY(pthread_mutex_init(&m_, 0) == 0);
+			VERIFY(pthread_cond_init(&got_, 0) == 0);
+			char hp[32];
+			snprintf(hp, sizeof(hp), "127.0.0.1:%d", port);
+			sockaddr_in dst;
+			make_sockaddr(hp, &dst);
+			c_ = connect_to_dst(dst, this);
+			VERIFY(c_ != NULL);
+			int v;
+			VERIFY(call(rpc_const::bind, 1000, 1, 0, v) == 0);
+			srv_nonce_ = v;
+		}
+
+		bool got_pdu(connection *c, char *b, int sz) {
+			unmarshall rep(b, sz);
+			reply_header h;
+			rep.unpack_reply_header(&h);
+			int v = 0;
+			if (h.ret >= 0)
+				rep >> v;
+			ScopedLock ml(&m_);
+			rets_[h.xid] = h.ret;
+			values_[h.xid] = v;
+			nreplies_[h.xid]++;
+			VERIFY(pthread_cond_broadcast(&got_) == 0);
+			return true;
+		}
+
+		void send(unsigned int proc, unsigned int clt_nonce, int xid,
+				int xid_rep) {
+			marshall m;
+			m << 0;
+			m.pack_req_header(req_header(xid, proc, clt_nonce, srv_nonce_,
+						xid_rep));
+			VERIFY(c_->send(m.cstr(), m.size()));
+		}
+
+		// the number of replies to xid so far
+		int replies(int xid) {
+			ScopedLock ml(&m_);
+			return nreplies_[xid];
+		}
+
+		// Send the request, wait for a reply to xid; its ret, or
+		// timeout_failure. A reply to xid got before is forgotten.
+		int call(unsigned int proc, unsigned int clt_nonce, int xid,
+				int xid_rep, int &v) {
+			{
+				ScopedLock ml(&m_);
+				nreplies_.erase(xid);
+			}
+			send(proc, clt_nonce, xid, xid_rep);
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += REPLY_WAIT;
+			ScopedLock ml(&m_);
+			while (nreplies_[xid] == 0)
+				if (pthread_cond_timedwait(&got_, &m_, &deadline) != 0)
+					return rpc_const::timeout_failure;
+			v = values_[xid];
+			return rets_[xid];
+		}
+};
+
+int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// a duplicate of an answered request gets the same reply, without the
+// request running again; one in progress gets nothing
+void
+test_duplicates(raw_client &cl, counter &cn, unsigned int nonce)
+{
+	int v1, v2;
+	CHECK(cl.call(inc, nonce, 1, 0, v1) == 0);
+	CHECK(cl.call(inc, nonce, 1, 0, v2) == 0);
+	CHECK(v2 == v1 && cn.n == v1);
+
+	cl.send(inc_slow, nonce, 2, 0);
+	usleep(100 * 1000);
+	cl.send(inc_slow, nonce, 2, 0);
+	usleep(600 * 1000);
+	CHECK(cl.replies(2) == 1 && cn.n == v1 + 1);
+	printf("duplicates done\n");
+}
+
+// an acknowledged reply is forgotten, and so is one that falls out of
+// the ring when a client runs too far ahead of its acknowledgements
+void
+test_forgotten(raw_client &cl, counter &cn, unsigned int nonce)
+{
+	int v;
+	CHECK(cl.call(inc, nonce, 1, 0, v) == 0);
+	CHECK(cl.call(inc, nonce, 2, 1, v) == 0);
+	CHECK(cl.call(inc, nonce, 1, 0, v) == rpc_const::atmostonce_failure);
+
+	int n = cn.n;
+	CHECK(cl.call(inc, nonce, 3, 1, v) == 0);
+	CHECK(cl.call(inc, nonce, 3 + 100000, 1, v) == 0);
+	CHECK(cl.call(inc, nonce, 3, 1, v) == rpc_const::atmostonce_failure);
+	CHECK(cn.n == n + 2);
+	printf("forgotten done\n");
+}
+
+// over RPC_REPLY_CAP, the replies of idempotent procedures are dropped,
+// and their duplicates run again; other replies are kept
+void
+test_dropped(raw_client &cl, counter &cn, unsigned int nonce)
+{
+	int v1, v2;
+	CHECK(cl.call(inc_idem, nonce, 1, 0, v1) == 0);
+	CHECK(cl.call(inc_idem, nonce, 1, 0, v2) == 0);
+	CHECK(v2 == v1 + 1);
+	CHECK(cl.call(inc, nonce, 2, 0, v1) == 0);
+	CHECK(cl.call(inc, nonce, 2, 0, v2) == 0);
+	CHECK(v2 == v1 && cn.n == v1);
+	printf("dropped done\n");
+}
+
+// the window of a client idle for RPC_REPLY_IDLE seconds is thrown away:
+// a late duplicate runs again
+void
+test_idle(raw_client &cl, counter &cn, unsigned int nonce)
+{
+	int v1, v2;
+	CHECK(cl.call(inc, nonce, 1, 0, v1) == 0);
+	sleep(3);
+	// windows are looked at when a client of the same shard calls
+	CHECK(cl.call(inc, nonce + 16, 1, 0, v2) == 0);
+	CHECK(cl.call(inc, nonce, 1, 0, v2) == 0);
+	CHECK(v2 == v1 + 2);
+	printf("idle done\n");
+}
+
+// the number after name in the statistics dump, -1 if none
+long long
+stat_of(const char *name)
+{
+	std::string d = rpc_stats_dump();
+	std::string::size_type at = d.find(std::string("\n") + name + " ");
+	if (at == std::string::npos)
+		return -1;
+	return atoll(d.c_str() + at + strlen(name) + 2);
+}
+
+// every request resent under its xid is a retransmit, and every request
+// waited in the dispatch pool
+void
+test_stats(raw_client &cl, unsigned int nonce)
+{
+	int v;
+	long long n = stat_of("retransmits");
+	long long jobs = stat_of("rpcs queue jobs");
+	CHECK(n >= 0 && jobs > 0);
+	CHECK(cl.call(inc, nonce, 1, 0, v) == 0);
+	CHECK(cl.call(inc, nonce, 2, 0, v) == 0);
+	CHECK(stat_of("retransmits") == n);
+	CHECK(cl.call(inc, nonce, 1, 0, v) == 0);
+	CHECK(stat_of("retransmits") == n + 1);
+	CHECK(stat_of("rpcs queue jobs") == jobs + 3);
+	printf("stats done\n");
+}
+
+// the instruction, where there is one, and the tables agree, on every
+// alignment and on lengths around their 8-byte steps
+void
+test_crc32c()
+{
+	const char *check = "123456789";
+	CHECK(crc32c(0, check, 9) == 0xe3069283);
+	CHECK(crc32c_tables(0, check, 9) == 0xe3069283);
+
+	std::string buf(70000, '\0');
+	srandom(1);
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = random();
+	std::string copy(buf.size(), '\0');
+	for (int off = 0; off < 8; off++) {
+		for (size_t n = 0; n < 300; n++) {
+			uint32_t c = crc32c(0, &buf[off], n);
+			CHECK(c == crc32c_tables(0, &buf[off], n));
+			CHECK(crc32c(crc32c(0, &buf[off], n / 3), &buf[off + n / 3],
+						n - n / 3) == c);
+		}
+		size_t n = buf.size() - off;
+		uint32_t c = crc32c_tables(0, &buf[off], n);
+		CHECK(crc32c(0, &buf[off], n) == c);
+		CHECK(crc32c_copy(0, &copy[0], &buf[off], n) == c);
+		CHECK(memcmp(&copy[0], &buf[off], n) == 0);
+	}
+	printf("crc32c done\n");
+}
+
+// a byte string with a CRC comes back as it went, one changed on the
+// way does not, and one without reads like a std::string
+void
+test_bytes()
+{
+	std::string data(5000, 'd');
+	data[100] = 'x';
+
+	marshall m;
+	m << rpc_bytes(data, true);
+	m << 7;
+	std::string wire = m.get_content();
+	unmarshall u(wire);
+	rpc_bytes b;
+	int seven;
+	u >> b;
+	u >> seven;
+	CHECK(u.okdone() && b.crc && seven == 7);
+	CHECK(std::string(b.data, b.len) == data);
+
+	std::string got;
+	rpc_string r(got);
+	unmarshall u2(wire);
+	u2 >> r;
+	CHECK(u2.ok() && !r.corrupt && got == data);
+
+	wire[wire.size() - 100] ^= 1;
+	unmarshall u3(wire);
+	u3 >> b;
+	CHECK(!u3.ok());
+	unmarshall u4(wire);
+	u4 >> r;
+	CHECK(u4.ok() && r.corrupt);
+
+	marshall m2;
+	m2 << rpc_bytes(data);
+	unmarshall u5(m2.get_content());
+	std::string s;
+	u5 >> s;
+	CHECK(u5.okdone() && s == data);
+	printf("bytes done\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+	// keep no idempotent replies, and forget idle clients soon
+	setenv("RPC_REPLY_CAP", "0", 1);
+	setenv("RPC_REPLY_IDLE", "2", 1);
+	test_crc32c();
+	test_bytes();
+	int port = argc > 1 ? atoi(argv[1]) : 20000 + getpid() % 20000;
+
+	counter cn;
+	rpcs server(port);
+	server.reg(inc, &cn, &counter::inc);
+	server.reg(inc_idem, &cn, &counter::inc);
+	server.reg(inc_slow, &cn, &counter::inc_slow);
+	server.set_idempotent(inc_idem);
+
+	raw_client cl(port);
+	test_duplicates(cl, cn, 1001);
+	test_forgotten(cl, cn, 1002);
+	test_dropped(cl, cn, 1003);
+	test_idle(cl, cn, 1004);
+	test_stats(cl, 1005);
+
+	printf("%s\n", failures ? "rpctest: FAILED" : "rpctest: OK");
+	return failures != 0;
+}
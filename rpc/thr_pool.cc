@@ -0,0 +1,40 @@
+// ThrPool, the pool rpcs dispatches requests to, on an LFThrPool.
+//
+// rpc.o in librpc.a makes, feeds and deletes its dispatch pool only
+// through ThrPool's constructor, destructor and addJob(), so these
+// take the place of the library's thr_pool.o. rpc.o allocates a
+// ThrPool of the size it was compiled with, THRPOOL_LIB_SIZE; the
+// handle here must fit in it.
+
+#include "thr_pool.h"
+
+#define THRPOOL_LIB_SIZE 248
+#define THRPOOL_JOBS     100  // queued jobs allowed per thread, as in the library
+
+typedef char thrpool_fits[sizeof(ThrPool) <= THRPOOL_LIB_SIZE ? 1 : -1];
+
+static unsigned int
+ring_size(unsigned int n)
+{
+	unsigned int s = 2;
+	while (s < n)
+		s *= 2;
+	return s;
+}
+
+ThrPool::ThrPool(int sz, bool blocking)
+	: lf_(new LFThrPool(sz, ring_size(sz * THRPOOL_JOBS), blocking, true))
+{
+}
+
+// waits for the queued jobs
+ThrPool::~ThrPool()
+{
+	delete lf_;
+}
+
+bool
+ThrPool::addJob(void *(*f)(void *), void *a)
+{
+	return lf_->addJob(f, a);
+}
@@ -3,9 +3,18 @@
 
 #include <pthread.h>
 #include <vector>
+#include <sched.h>
 
 #include "fifo.h"
+#include "mpmc_ring.h"
+#include "rpc_stats.h"
 
+class LFThrPool;
+
+// The pool rpcs dispatches requests to. It runs on an LFThrPool, see
+// thr_pool.cc. With blocking false, addObjJob() fails rather than wait
+// when the queue is full. The time each job waits in the queue is
+// recorded with rpc_stat_queue_wait().
 class ThrPool {
 
 
@@ -13,29 +22,166 @@ class ThrPool {
 		struct job_t {
 			void *(*f)(void *); //function point
 			void *a; //function arguments
+			uint64_t queued; //rpc_stat_now() when added, in a timed pool
 		};
 
 		ThrPool(int sz, bool blocking=true);
 		~ThrPool();
 		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
-		void waitDone();
-
-		bool takeJob(job_t *j);
 
 	private:
-		pthread_attr_t attr_;
-		int nthreads_;
-		bool blockadd_;
+		LFThrPool *lf_;
+
+		bool addJob(void *(*f)(void *), void *a);
+};
+
+	template <class C, class A> bool 
+ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
+{
+
+	class objfunc_wrapper {
+		public:
+			C *o;
+			void (C::*m)(A a);
+			A a;
+			static void *func(void *vvv) {
+				objfunc_wrapper *x = (objfunc_wrapper*)vvv;
+				C *o = x->o;
+				void (C::*m)(A ) = x->m;
+				A a = x->a;
+				(o->*m)(a);
+				delete x;
+				return 0;
+			}
+	};
+
+	objfunc_wrapper *x = new objfunc_wrapper;
+	x->o = o;
+	x->m = m;
+	x->a = a;
+	return addJob(&objfunc_wrapper::func, (void *)x);
+}
+
+
+// A job pool whose jobs go through an mpmc_ring instead of a locked
+// fifo. An idle worker polls the ring LFTHRPOOL_SPINS times before
+// going to sleep, and addJob() only takes the sleep lock when some
+// worker is asleep. While the ring is full addJob() blocks (yielding),
+// or with blocking false fails. A timed pool records how long each job
+// waited for a worker.
+#define LFTHRPOOL_SPINS 100
 
+class LFThrPool {
+	public:
+		LFThrPool(int sz, unsigned int qsize = 1024, bool blocking = true,
+				bool timed = false);
+		~LFThrPool();
+		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
+
+	private:
+		friend class ThrPool;
 
-		fifo<job_t> jobq_;
+		mpmc_ring<ThrPool::job_t> jobq_;
 		std::vector<pthread_t> th_;
+		bool blocking_;
+		const bool timed_;
+		int nsleepers_;  // workers asleep or about to be, on c_
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
 
 		bool addJob(void *(*f)(void *), void *a);
+		void takeJob(ThrPool::job_t *j);
+		static void *worker(void *);
 };
 
+inline
+LFThrPool::LFThrPool(int sz, unsigned int qsize, bool blocking, bool timed)
+	: jobq_(qsize), blocking_(blocking), timed_(timed), nsleepers_(0)
+{
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&c_, 0) == 0);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 128<<10);
+	for (int i = 0; i < sz; i++) {
+		pthread_t t;
+		VERIFY(pthread_create(&t, &attr, &LFThrPool::worker, (void *)this) == 0);
+		th_.push_back(t);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+// wait for the queued jobs, then stop the workers
+inline
+LFThrPool::~LFThrPool()
+{
+	blocking_ = true;
+	for (unsigned int i = 0; i < th_.size(); i++)
+		addJob(NULL, NULL);
+	for (unsigned int i = 0; i < th_.size(); i++)
+		VERIFY(pthread_join(th_[i], NULL) == 0);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+	VERIFY(pthread_cond_destroy(&c_) == 0);
+}
+
+inline bool
+LFThrPool::addJob(void *(*f)(void *), void *a)
+{
+	ThrPool::job_t j;
+	j.f = f;
+	j.a = a;
+	j.queued = timed_ ? rpc_stat_now() : 0;
+	while (!jobq_.enq(j)) {
+		if (!blocking_)
+			return false;
+		sched_yield();
+	}
+
+	// pairs with the fence in takeJob(): either the worker's last poll
+	// sees the job, or we see that it went to sleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&nsleepers_, __ATOMIC_RELAXED) > 0) {
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_signal(&c_) == 0);
+	}
+	return true;
+}
+
+inline void
+LFThrPool::takeJob(ThrPool::job_t *j)
+{
+	for (int i = 0; i < LFTHRPOOL_SPINS; i++) {
+		if (jobq_.deq(j))
+			return;
+		sched_yield();
+	}
+
+	ScopedLock ml(&m_);
+	__atomic_add_fetch(&nsleepers_, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!jobq_.deq(j))
+		VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+	__atomic_sub_fetch(&nsleepers_, 1, __ATOMIC_RELAXED);
+}
+
+inline void *
+LFThrPool::worker(void *arg)
+{
+	LFThrPool *tp = (LFThrPool *)arg;
+	while (1) {
+		ThrPool::job_t j;
+		tp->takeJob(&j);
+		if (!j.f)
+			break;
+		if (tp->timed_)
+			rpc_stat_queue_wait(rpc_stat_now() - j.queued);
+		(void)(j.f)(j.a);
+	}
+	return 0;
+}
+
 	template <class C, class A> bool 
-ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
+LFThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 {
 
 	class objfunc_wrapper {
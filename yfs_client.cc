@@ -1,6 +1,7 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "ylog.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -9,18 +10,33 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string>
+#include <vector>
+#include <string.h>
+#include <stddef.h>
+#include "slock.h"
 
 yfs_client::yfs_client()
 {
     ec = new extent_client();
-
+    for (int i = 0; i < NLOCKS; i++)
+        VERIFY(pthread_mutex_init(&locks[i], NULL) == 0);
 }
 
+// Use the extent server at extent_dst ("host:port"). The root dir
+// already exists there, and other clients may be sharing it.
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
 {
-    ec = new extent_client();
-    if (ec->put(1, "") != extent_protocol::OK)
-        printf("error init root dir\n"); // XYB: init root dir
+    ec = new extent_client(extent_dst);
+    for (int i = 0; i < NLOCKS; i++)
+        VERIFY(pthread_mutex_init(&locks[i], NULL) == 0);
+}
+
+// The lock of inode inum. Inodes share NLOCKS locks, and a thread
+// never holds more than one of them.
+pthread_mutex_t *
+yfs_client::ilock(inum inum)
+{
+    return &locks[inum % NLOCKS];
 }
 
 yfs_client::inum
@@ -46,15 +62,15 @@ yfs_client::isfile(inum inum)
     extent_protocol::attr a;
 
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
+        ylog(JSL_DBG_2, "error getting attr\n");
         return false;
     }
 
     if (a.type == extent_protocol::T_FILE) {
-        printf("isfile: %lld is a file\n", inum);
+        ylog(JSL_DBG_4, "isfile: %lld is a file\n", inum);
         return true;
     } 
-    printf("isfile: %lld is not a file\n", inum);
+    ylog(JSL_DBG_4, "isfile: %lld is not a file\n", inum);
     return false;
 }
 /** Your code here for Lab...
@@ -66,8 +82,9 @@ yfs_client::isfile(inum inum)
 int yfs_client::readlink(inum inum, std::string &buf)
 {
     int r = OK;
-    printf("my_readlink: %lld\n", inum);
-    ec->get(inum, buf);
+    ylog(JSL_DBG_4, "my_readlink: %lld\n", inum);
+    if (ec->get(inum, buf) != extent_protocol::OK)
+        r = IOERR;
     return r;
 }
 
@@ -76,15 +93,15 @@ bool yfs_client::issymlink(inum inum)
     extent_protocol::attr a;
 
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error get attr\n");
+        ylog(JSL_DBG_2, "error get attr\n");
         return false;
     } 
 
     if(a.type == extent_protocol::T_SYMLINK) {
-        printf("issymlink: %lld is a symbolic link\n", inum);
+        ylog(JSL_DBG_4, "issymlink: %lld is a symbolic link\n", inum);
         return true;
     }
-    printf("issymlink: %lld is not a symbolic link\n", inum);
+    ylog(JSL_DBG_4, "issymlink: %lld is not a symbolic link\n", inum);
     return false;
 }
 
@@ -96,15 +113,15 @@ yfs_client::isdir(inum inum)
     extent_protocol::attr a;
 
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error get attr\n");
+        ylog(JSL_DBG_2, "error get attr\n");
         return false;
     }
 
     if (a.type == extent_protocol::T_DIR) {
-        printf("isdir: %lld is a dir\n", inum);
+        ylog(JSL_DBG_4, "isdir: %lld is a dir\n", inum);
         return true;
     }
-    printf("isdir: %lld is not a dir\n", inum);
+    ylog(JSL_DBG_4, "isdir: %lld is not a dir\n", inum);
     return false;
 }
 
@@ -113,7 +130,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
 {
     int r = OK;
 
-    printf("getfile %016llx\n", inum);
+    ylog(JSL_DBG_4, "getfile %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -124,7 +141,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
     fin.mtime = a.mtime;
     fin.ctime = a.ctime;
     fin.size = a.size;
-    printf("getfile %016llx -> sz %llu\n", inum, fin.size);
+    ylog(JSL_DBG_4, "getfile %016llx -> sz %llu\n", inum, fin.size);
 
 release:
     return r;
@@ -135,7 +152,7 @@ yfs_client::getdir(inum inum, dirinfo &din)
 {
     int r = OK;
 
-    printf("getdir %016llx\n", inum);
+    ylog(JSL_DBG_4, "getdir %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -149,10 +166,67 @@ release:
     return r;
 }
 
+// Fill st with the type, size and times of inum, all from one
+// extent getattr. YFS fakes the rest: permissions, owner, link count.
+int
+yfs_client::getstat(inum inum, struct stat &st)
+{
+    extent_protocol::attr a;
+
+    memset(&st, 0, sizeof(st));
+    if (ec->getattr(inum, a) != extent_protocol::OK)
+        return IOERR;
+
+    switch (a.type) {
+    case extent_protocol::T_FILE:
+        st.st_mode = S_IFREG | 0666;
+        st.st_nlink = 1;
+        break;
+    case extent_protocol::T_DIR:
+        st.st_mode = S_IFDIR | 0777;
+        st.st_nlink = 2;
+        break;
+    case extent_protocol::T_SYMLINK:
+        st.st_mode = S_IFLNK | 0777;
+        st.st_nlink = 1;
+        break;
+    default:
+        return NOENT;
+    }
+    st.st_ino = inum;
+    st.st_size = a.size;
+    st.st_atime = a.atime;
+    st.st_mtime = a.mtime;
+    st.st_ctime = a.ctime;
+    ylog(JSL_DBG_4, "getstat %016llx -> type %u sz %u\n", inum, a.type, a.size);
+    return OK;
+}
+
+int
+yfs_client::statfs(fsinfo &fin)
+{
+    int r = OK;
+
+    ylog(JSL_DBG_4, "statfs\n");
+    extent_protocol::fsstat st;
+    if (ec->statfs(st) != extent_protocol::OK) {
+        r = IOERR;
+        goto release;
+    }
+    fin.bsize = st.bsize;
+    fin.blocks = st.blocks;
+    fin.bfree = st.bfree;
+    fin.files = st.files;
+    fin.ffree = st.ffree;
+
+release:
+    return r;
+}
+
 
 #define EXT_RPC(xx) do { \
     if ((xx) != extent_protocol::OK) { \
-        printf("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
+        ylog(JSL_DBG_2, "EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
         r = IOERR; \
         goto release; \
     } \
@@ -169,11 +243,16 @@ yfs_client::setattr(inum ino, size_t size)
      * note: get the content of inode ino, and modify its content
      * according to the size (<, =, or >) content length.
      */
+    if (size > extent_protocol::MAXSIZE) {
+        r = FBIG;
+        return r;
+    }
+
+    ScopedLock fl(ilock(ino));
     std::string content;
-    ec->get(ino, content);
     extent_protocol::attr a;
-    ec->getattr(ino, a);
-    if (a.type == 0) {
+    if (ec->get_with_attr(ino, content, a) != extent_protocol::OK ||
+        a.type == 0) {
         r = IOERR;
         return r;
     }
@@ -187,8 +266,309 @@ yfs_client::setattr(inum ino, size_t size)
         content = content.substr(0, size);
         a.size = size;
     }
-    ec->put(ino, content);
+    extent_protocol::status ret = ec->put(ino, content);
+    if (ret != extent_protocol::OK)
+        r = ret == extent_protocol::NOSPC ? NOSPC : IOERR;
+
+    return r;
+}
+
+// Directory format ---------------------------------------------------
+//
+// A directory is a hash table kept in the directory's own bytes:
+//
+// |<-dir_header->|<-bucket table->|<-records...->|
+//
+// The bucket table holds nbuckets record offsets, each the head of the
+// chain of records whose names hash to that bucket (0 ends a chain).
+// A record is sized to fit its name, in DIR_ALIGN units; a removed
+// record goes on the free list for its size and is reused by the next
+// insert of that size. lookup, insert and remove only touch the header,
+// one bucket and the records on one chain. When the chains get long the
+// directory is rewritten with twice the buckets, minus the free records.
+
+#define DIR_MAGIC       0x79646972  // "ydir"
+#define DIR_MIN_BUCKETS 16
+#define DIR_ALIGN       32
+#define DIR_NAMEMAX     255
+
+struct dir_record {
+    uint32_t next;      // next record on the chain or free list, 0 if none
+    uint32_t hash;
+    uint64_t inum;      // 0 if the record is free
+    uint16_t reclen;    // bytes taken by the record, name included
+    uint16_t namelen;
+    // the name follows, not NUL terminated
+};
+
+#define DIR_RECLEN(namelen) \
+    ((sizeof(dir_record) + (namelen) + DIR_ALIGN - 1) / DIR_ALIGN * DIR_ALIGN)
+
+struct dir_header {
+    uint32_t magic;
+    uint32_t nbuckets;  // a power of two
+    uint32_t nentries;
+    uint32_t end;       // where the next new record goes
+    uint32_t free_list[DIR_RECLEN(DIR_NAMEMAX) / DIR_ALIGN + 1];  // by reclen
+};
+
+// Offset of bucket b in the directory
+#define DIR_BUCKET(b)   (sizeof(dir_header) + (b) * sizeof(uint32_t))
+
+static uint32_t
+dir_hash(const char *name, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static std::string
+u32_bytes(uint32_t v)
+{
+    return std::string((const char *)&v, sizeof(v));
+}
+
+// Queue a write_range of data at off in ino as part of a compound call.
+static void
+add_write(std::vector<extent_protocol::op> &ops, yfs_client::inum ino,
+          uint32_t off, const std::string &data)
+{
+    extent_protocol::op o;
+    o.type = extent_protocol::write_range;
+    o.id = ino;
+    o.off = off;
+    o.n = 0;
+    o.data = data;
+    ops.push_back(o);
+}
+
+// Lay out entries as a directory with nbuckets buckets.
+static std::string
+dir_build(const std::list<yfs_client::dirent> &entries, uint32_t nbuckets)
+{
+    dir_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = DIR_MAGIC;
+    h.nbuckets = nbuckets;
+    h.nentries = entries.size();
+    h.end = DIR_BUCKET(nbuckets);
+
+    std::vector<uint32_t> table(nbuckets, 0);
+    std::string recs;
+    for (std::list<yfs_client::dirent>::const_iterator it = entries.begin();
+         it != entries.end(); it++) {
+        dir_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hash = dir_hash(it->name.data(), it->name.size());
+        rec.inum = it->inum;
+        rec.reclen = DIR_RECLEN(it->name.size());
+        rec.namelen = it->name.size();
+        uint32_t at = recs.size();
+        rec.next = table[rec.hash & (nbuckets - 1)];
+        table[rec.hash & (nbuckets - 1)] = h.end + at;
+
+        recs.append((const char *)&rec, sizeof(rec));
+        recs += it->name;
+        recs.resize(at + rec.reclen, '\0');
+    }
+    h.end += recs.size();
+
+    std::string buf((const char *)&h, sizeof(h));
+    buf.append((const char *)&table[0], nbuckets * sizeof(uint32_t));
+    buf += recs;
+    return buf;
+}
+
+// Read the header of directory dir.
+// A directory nobody has added to yet is empty, with nbuckets == 0.
+int
+yfs_client::dir_load(inum dir, dir_header &h)
+{
+    std::string buf;
+    if (ec->read_range(dir, 0, sizeof(h), buf) != extent_protocol::OK)
+        return IOERR;
+    memset(&h, 0, sizeof(h));
+    if (buf.empty())
+        return OK;
+    if (buf.size() != sizeof(h)) {
+        ylog(JSL_DBG_2, "error bad directory %llu\n", dir);
+        return IOERR;
+    }
+    memcpy(&h, buf.data(), sizeof(h));
+    if (h.magic != DIR_MAGIC || h.nbuckets == 0) {
+        ylog(JSL_DBG_2, "error bad directory %llu\n", dir);
+        return IOERR;
+    }
+    return OK;
+}
+
+// Find name on its chain in directory dir.
+// On success rec is its record, at offset off. prev is the record
+// before it on the chain, or, if name is not there (NOENT), the last
+// record on the chain; 0 if there is none.
+int
+yfs_client::dir_find(inum dir, const dir_header &h, const char *name,
+                     uint32_t &off, uint32_t &prev, dir_record &rec)
+{
+    size_t len = strlen(name);
+    uint32_t hash = dir_hash(name, len);
+    std::string buf;
+
+    if (ec->read_range(dir, DIR_BUCKET(hash & (h.nbuckets - 1)),
+                       sizeof(uint32_t), buf) != extent_protocol::OK ||
+        buf.size() != sizeof(uint32_t))
+        return IOERR;
+    memcpy(&off, buf.data(), sizeof(off));
+    prev = 0;
+
+    while (off != 0) {
+        if (ec->read_range(dir, off, sizeof(rec) + len, buf) !=
+            extent_protocol::OK || buf.size() < sizeof(rec))
+            return IOERR;
+        memcpy(&rec, buf.data(), sizeof(rec));
+        if (rec.hash == hash && rec.namelen == len &&
+            buf.compare(sizeof(rec), len, name) == 0)
+            return OK;
+        prev = off;
+        off = rec.next;
+    }
+    return NOENT;
+}
+
+// Get ready to add name to directory dir: h is its header, prev the
+// last record on the chain of name, 0 if there is none.
+// Return EXIST if the name is taken.
+int
+yfs_client::dir_probe(inum dir, const char *name, dir_header &h,
+                      uint32_t &prev)
+{
+    int r;
+    size_t len = strlen(name);
+
+    if (len == 0 || len > DIR_NAMEMAX)
+        return IOERR;
+    prev = 0;
+    if ((r = dir_load(dir, h)) != OK || h.nbuckets == 0)
+        return r;
+
+    uint32_t off;
+    dir_record rec;
+    r = dir_find(dir, h, name, off, prev, rec);
+    if (r == OK)
+        return EXIST;
+    return r == NOENT ? OK : r;
+}
+
+// Add the entry name -> ino to directory dir, with the h and prev of
+// dir_probe(); the caller holds the lock of dir in between.
+int
+yfs_client::dir_add(inum dir, const char *name, inum ino, dir_header &h,
+                    uint32_t prev)
+{
+    int r = OK;
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::result> res;
+    size_t len = strlen(name);
+
+    if (h.nbuckets == 0 || h.nentries >= 2 * h.nbuckets) {
+        // first entry, or the chains got long: rewrite the directory
+        std::list<dirent> entries;
+        if (h.nbuckets != 0 && (r = dir_list(dir, entries)) != OK)
+            return r;
+        dirent entry;
+        entry.name = name;
+        entry.inum = ino;
+        entries.push_back(entry);
+        uint32_t nbuckets = h.nbuckets ? 2 * h.nbuckets : DIR_MIN_BUCKETS;
+        if (ec->put(dir, dir_build(entries, nbuckets)) != extent_protocol::OK)
+            return IOERR;
+        return OK;
+    }
+
+    uint32_t off;
+    dir_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.hash = dir_hash(name, len);
+    rec.inum = ino;
+    rec.reclen = DIR_RECLEN(len);
+    rec.namelen = len;
+
+    // reuse a free record of this size, or append one
+    uint32_t *free_head = &h.free_list[rec.reclen / DIR_ALIGN];
+    if (*free_head != 0) {
+        std::string buf;
+        off = *free_head;
+        if (ec->read_range(dir, off, sizeof(uint32_t), buf) !=
+            extent_protocol::OK || buf.size() != sizeof(uint32_t))
+            return IOERR;
+        memcpy(free_head, buf.data(), sizeof(uint32_t));
+    } else {
+        off = h.end;
+        h.end += rec.reclen;
+    }
+
+    // the record first, then what points to it, all in one message
+    {
+        std::string buf((const char *)&rec, sizeof(rec));
+        buf.append(name, len);
+        buf.resize(rec.reclen, '\0');
+        add_write(ops, dir, off, buf);
+    }
+    if (prev == 0)
+        add_write(ops, dir, DIR_BUCKET(rec.hash & (h.nbuckets - 1)),
+                  u32_bytes(off));
+    else
+        add_write(ops, dir, prev + offsetof(dir_record, next), u32_bytes(off));
+    h.nentries++;
+    add_write(ops, dir, 0, std::string((const char *)&h, sizeof(h)));
+    EXT_RPC(ec->compound(ops, res));
 
+release:
+    return r;
+}
+
+// Remove the entry name from directory dir, setting ino to its inum.
+int
+yfs_client::dir_remove(inum dir, const char *name, inum &ino)
+{
+    int r;
+    dir_header h;
+    uint32_t off, prev, *free_head;
+    dir_record rec;
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::result> res;
+
+    if ((r = dir_load(dir, h)) != OK)
+        return r;
+    if (h.nbuckets == 0)
+        return NOENT;
+
+    if ((r = dir_find(dir, h, name, off, prev, rec)) != OK)
+        return r;
+    ino = rec.inum;
+
+    if (prev == 0)
+        add_write(ops, dir, DIR_BUCKET(rec.hash & (h.nbuckets - 1)),
+                  u32_bytes(rec.next));
+    else
+        add_write(ops, dir, prev + offsetof(dir_record, next),
+                  u32_bytes(rec.next));
+
+    free_head = &h.free_list[rec.reclen / DIR_ALIGN];
+    rec.next = *free_head;
+    rec.inum = 0;
+    add_write(ops, dir, off, std::string((const char *)&rec, sizeof(rec)));
+    *free_head = off;
+    h.nentries--;
+    add_write(ops, dir, 0, std::string((const char *)&h, sizeof(h)));
+    EXT_RPC(ec->compound(ops, res));
+
+release:
     return r;
 }
 
@@ -202,30 +582,17 @@ yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
      * note: lookup is what you need to check if file exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    bool found = false;
-    inum file_inum;
-    r = lookup(parent, name, found, file_inum);
-    if (r == OK && found) {
-        r = EXIST;
-    }
-    else {
-        std::list<dirent> entries;
-        readdir(parent, entries);
-        ec->create(extent_protocol::T_FILE, ino_out);
-        dirent entry;
-        entry.inum = ino_out;
-        entry.name = name;
-        entries.push_back(entry);
+    dir_header h;
+    uint32_t prev;
+    ScopedLock dl(ilock(parent));
+    if ((r = dir_probe(parent, name, h, prev)) != OK)
+        return r;
 
-        // format directory entries
-        std::string content;
-        for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); it++) {
-            std::ostringstream stream;
-            stream << it->name << "\\:" << it->inum << "\\;";
-            content += stream.str();
-        }
-        ec->put(parent, content);
-    }
+    EXT_RPC(ec->create(extent_protocol::T_FILE, ino_out));
+    if ((r = dir_add(parent, name, ino_out, h, prev)) != OK)
+        ec->remove(ino_out);
+
+release:
     return r;
 }
 
@@ -239,31 +606,17 @@ yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
      * note: lookup is what you need to check if directory exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
-    bool found = false;
-    inum file_inum;
-    r = lookup(parent, name, found, file_inum);
-    if (r == OK && found) {
-        r = EXIST;
-    }
-    else {
-        std::list<dirent> entries;
-        readdir(parent, entries);
-        ec->create(extent_protocol::T_DIR, ino_out);
-        dirent entry;
-        entry.inum = ino_out;
-        entry.name = name;
-        entries.push_back(entry);
-        
-        // format directory entries
-        std::string content;
-        for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); it++) {
-            std::ostringstream stream;
-            stream << it->name << "\\:" << it->inum << "\\;";
-            content += stream.str();
-        }
-        ec->put(parent, content);
-    }
-    
+    dir_header h;
+    uint32_t prev;
+    ScopedLock dl(ilock(parent));
+    if ((r = dir_probe(parent, name, h, prev)) != OK)
+        return r;
+
+    EXT_RPC(ec->create(extent_protocol::T_DIR, ino_out));
+    if ((r = dir_add(parent, name, ino_out, h, prev)) != OK)
+        ec->remove(ino_out);
+
+release:
     return r;
 }
 
@@ -272,39 +625,49 @@ yfs_client::symlink(inum parent, const char *link, mode_t mode, const char *name
 {
     int r = OK;
 
-    bool found = false;
-    r = lookup(parent, name, found, ino_out);
-    if (r == OK && found) {
-        r = EXIST;
+    dir_header h;
+    uint32_t prev;
+    std::vector<extent_protocol::op> ops(2);
+    std::vector<extent_protocol::result> res;
+    ScopedLock dl(ilock(parent));
+    if ((r = dir_probe(parent, name, h, prev)) != OK)
         return r;
-    }
-    else {
-        std::list<dirent> entries;
-        readdir(parent, entries);
-        ino_out = 0;
-        if ((r = ec->create(extent_protocol::T_SYMLINK, ino_out)) != extent_protocol::OK) {
-            return r;
-        }
-        dirent entry;
-        entry.inum = ino_out;
-        entry.name = name;
-        entries.push_back(entry);
 
-        // format directory entries
-        std::string content;
-        for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); it++) {
-            std::ostringstream stream;
-            stream << it->name << "\\:" << it->inum << "\\;";
-            content += stream.str();
-        }
-        ec->put(parent, content);
-        ec->put(ino_out, link);
+    // create the inode and write the target in one call
+    ops[0].type = extent_protocol::create;
+    ops[0].id = 0;
+    ops[0].off = 0;
+    ops[0].n = extent_protocol::T_SYMLINK;
+    ops[1].type = extent_protocol::put;
+    ops[1].id = 0;
+    ops[1].off = 0;
+    ops[1].n = 0;
+    ops[1].data = link;
+    ino_out = 0;
+    if (ec->compound(ops, res) != extent_protocol::OK) {
+        ylog(JSL_DBG_2, "yfs_client: symlink: compound failed\n");
+        // the create may have gone through before the put failed
+        if (!res.empty() && res[0].ret == extent_protocol::OK)
+            ec->remove(res[0].id);
+        return IOERR;
     }
+    ino_out = res[0].id;
+    if ((r = dir_add(parent, name, ino_out, h, prev)) != OK)
+        ec->remove(ino_out);
+
     return r;
 }
 
 int
 yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
+{
+    ScopedLock dl(ilock(parent));
+    return dir_lookup(parent, name, found, ino_out);
+}
+
+int
+yfs_client::dir_lookup(inum parent, const char *name, bool &found,
+                       inum &ino_out)
 {
     int r = OK;
 
@@ -314,20 +677,31 @@ yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
      * you should design the format of directory content.
      */
     found = false;
-    std::list<dirent> entries = std::list<dirent>();
-    readdir(parent, entries);
-    for (std::list<dirent>::iterator it = entries.begin(); 
-        it != entries.end(); it++) {
-        if (it->name.compare(name) == 0) {
-            ino_out = it->inum;
-            found = true;
-        }
+    dir_header h;
+    if ((r = dir_load(parent, h)) != OK || h.nbuckets == 0)
+        return r;
+
+    uint32_t off, prev;
+    dir_record rec;
+    r = dir_find(parent, h, name, off, prev, rec);
+    if (r == OK) {
+        found = true;
+        ino_out = rec.inum;
+    } else if (r == NOENT) {
+        r = OK;
     }
     return r;
 }
 
 int
 yfs_client::readdir(inum dir, std::list<dirent> &list)
+{
+    ScopedLock dl(ilock(dir));
+    return dir_list(dir, list);
+}
+
+int
+yfs_client::dir_list(inum dir, std::list<dirent> &list)
 {
     int r = OK;
 
@@ -337,23 +711,32 @@ yfs_client::readdir(inum dir, std::list<dirent> &list)
      * and push the dirents to the list.
      */
     std::string buf;
-    ec->get(dir, buf);
-    std::string::size_type pos1 = 0;
-    std::string::size_type pos2 = buf.find("\\;", pos1);
-    while (pos2 != buf.npos && pos1 != pos2) {
-        std::string ss = buf.substr(pos1, pos2);
-        std::string::size_type subpos1 = 0;
-        std::string::size_type subpos2 = ss.find("\\:");
+    if (ec->get(dir, buf) != extent_protocol::OK)
+        return IOERR;
+    if (buf.empty())
+        return r;
+
+    dir_header h;
+    if (buf.size() < sizeof(h))
+        return IOERR;
+    memcpy(&h, buf.data(), sizeof(h));
+    if (h.magic != DIR_MAGIC)
+        return IOERR;
+
+    // the records follow the bucket table back to back, free ones included
+    uint32_t end = h.end < buf.size() ? h.end : buf.size();
+    dir_record rec;
+    for (uint32_t off = DIR_BUCKET(h.nbuckets); off + sizeof(rec) <= end;
+         off += rec.reclen) {
+        memcpy(&rec, buf.data() + off, sizeof(rec));
+        if (rec.reclen == 0)
+            return IOERR;
+        if (rec.inum == 0)
+            continue;
         struct dirent entry;
-        entry.name = ss.substr(subpos1, subpos2);
-        subpos1 = subpos2 + 2;
-        subpos2 = ss.size();
-        std::string inum_str = ss.substr(subpos1, subpos2);
-        entry.inum = n2i(inum_str);
+        entry.name.assign(buf, off + sizeof(rec), rec.namelen);
+        entry.inum = rec.inum;
         list.push_back(entry);
-
-        pos1 = pos2 + 2;
-        pos2 = buf.find("\\;", pos1);
     }
 
     return r;
@@ -368,24 +751,23 @@ yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
      * your code goes here.
      * note: read using ec->get().
      */
-    std::string content;
-    ec->get(ino, content);
+    // only the blocks covering [off, off + size) are fetched, along with
+    // the attributes; the data is dropped if they say it is not a file
     extent_protocol::attr a;
-    ec->getattr(ino, a);
+    if (ec->read_range_with_attr(ino, off, size, data, a) !=
+        extent_protocol::OK) {
+        data = "";
+        r = IOERR;
+        goto end;
+    }
     if (a.type == 0 || a.type == extent_protocol::T_DIR) {
+        data = "";
         r = NOENT;
         goto end;
     }
 
-    if (off >= a.size) {
+    if (off >= a.size)
         data = "";
-        goto end;
-    }
-    if (off + size > a.size) {
-        data = content.substr(off, a.size - off);
-        goto end;
-    }
-    data = content.substr(off, size);
 
 end:
     return r;
@@ -402,38 +784,30 @@ yfs_client::write(inum ino, size_t size, off_t off, const char *data,
      * note: write using ec->put().
      * when off > length of original file, fill the holes with '\0'.
      */
+    // offsets are 32 bits below the fuse layer
+    if (off < 0 || (unsigned long long)off + size > extent_protocol::MAXSIZE) {
+        r = FBIG;
+        return r;
+    }
 
-    // data contains \0 before end, construct string with two params.
-    std::string new_content(data, size);
-    std::string old_content;
+    // setattr resizes by get and put, which must not straddle a write
+    ScopedLock fl(ilock(ino));
     extent_protocol::attr a;
-    ec->getattr(ino, a);
-    if (a.type != extent_protocol::T_FILE) {
+    if (ec->getattr(ino, a) != extent_protocol::OK ||
+        a.type != extent_protocol::T_FILE) {
         r = IOERR;
         return r;
     }
 
-    ec->get(ino, old_content);
-    // fill the hole with zeros
-    if (off > a.size) {
-        std::string padding(off - a.size, '\0');
-        old_content += padding + new_content;
-    }
-    // append the file
-    else if (off == a.size) {
-        old_content += new_content;
-    }
-    // write into middle of a file
-    else {
-        std::string sub = old_content.substr(0, off);
-        sub += new_content;
-        if (off + size < a.size) {
-            sub += old_content.substr(off+size, a.size - off - size);
-        }
-        old_content = sub;
+    // data contains \0 before end, construct string with two params.
+    // the extent server fills any hole past the old end with zeros.
+    std::string new_content(data, size);
+    extent_protocol::status ret = ec->write_range(ino, off, new_content);
+    if (ret != extent_protocol::OK) {
+        r = ret == extent_protocol::NOSPC ? NOSPC : IOERR;
+        return r;
     }
     bytes_written = size;
-    ec->put(ino, old_content);
     return r;
 }
 
@@ -446,31 +820,37 @@ int yfs_client::unlink(inum parent,const char *name)
      * note: you should remove the file using ec->remove,
      * and update the parent directory content.
      */
-    std::list<dirent> entries;
-    readdir(parent, entries);
-
-    bool found = false;
-    for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); it++){
-        if (it->name.compare(name) == 0) {
-            found = true;
-            ec->remove(it->inum);
-            entries.erase(it);
-            break;
-        }
-    }
+    inum ino;
+    ScopedLock dl(ilock(parent));
+    if ((r = dir_remove(parent, name, ino)) != OK)
+        return r;
+    if (ec->remove(ino) != extent_protocol::OK)
+        r = IOERR;
+    return r;
+}
 
-    if (!found) {
-        r = NOENT;
-    }
-    else {
-        std::string content;
-        for (std::list<dirent>::iterator it = entries.begin(); it != entries.end(); it++) {
-            std::ostringstream stream;
-            stream << it->name << "\\:" << it->inum << "\\;";
-            content += stream.str();
-        }
-        ec->put(parent, content);
+int
+yfs_client::fsync(inum ino)
+{
+    switch (ec->flush(ino)) {
+    case extent_protocol::OK:
+        return OK;
+    case extent_protocol::NOSPC:
+        return NOSPC;
+    case extent_protocol::FBIG:
+        return FBIG;
+    default:
+        return IOERR;
     }
-    return r;
 }
 
+int
+yfs_client::sync()
+{
+    int r = OK;
+    if (ec->flush() != extent_protocol::OK)
+        r = IOERR;
+    std::string s = ec->cache_stats();
+    ylog(JSL_DBG_3, "%s", s.c_str());
+    return r;
+}
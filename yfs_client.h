@@ -5,14 +5,22 @@
 //#include "yfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <pthread.h>
+#include <sys/stat.h>
 
+struct dir_header;
+struct dir_record;
 
 class yfs_client {
   extent_client *ec;
+  // directory operations, setattr and write hold the lock of the inode
+  // they change or read, see ilock()
+  enum { NLOCKS = 257 };
+  pthread_mutex_t locks[NLOCKS];
  public:
 
   typedef unsigned long long inum;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, NOSPC, FBIG };
   typedef int status;
 
   struct fileinfo {
@@ -26,6 +34,13 @@ class yfs_client {
     unsigned long mtime;
     unsigned long ctime;
   };
+  struct fsinfo {
+    unsigned long bsize;
+    unsigned long blocks;
+    unsigned long bfree;
+    unsigned long files;
+    unsigned long ffree;
+  };
   struct dirent {
     std::string name;
     yfs_client::inum inum;
@@ -35,6 +50,16 @@ class yfs_client {
   static std::string filename(inum);
   static inum n2i(std::string);
 
+  pthread_mutex_t *ilock(inum);
+  int dir_lookup(inum, const char *, bool &, inum &);
+  int dir_list(inum, std::list<dirent> &);
+  int dir_load(inum, dir_header &);
+  int dir_find(inum, const dir_header &, const char *, uint32_t &, uint32_t &,
+               dir_record &);
+  int dir_probe(inum, const char *, dir_header &, uint32_t &);
+  int dir_add(inum, const char *, inum, dir_header &, uint32_t);
+  int dir_remove(inum, const char *, inum &);
+
  public:
   yfs_client();
   yfs_client(std::string, std::string);
@@ -45,6 +70,8 @@ class yfs_client {
 
   int getfile(inum, fileinfo &);
   int getdir(inum, dirinfo &);
+  int getstat(inum, struct stat &);
+  int statfs(fsinfo &);
 
   int setattr(inum, size_t);
   int lookup(inum, const char *, bool &, inum &);
@@ -56,6 +83,9 @@ class yfs_client {
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
   int symlink(inum, const char *, mode_t, const char *, inum &);
+  // write back what the extent cache holds of inum, or of everything
+  int fsync(inum);
+  int sync();
   
   /** you may need to add symbolic link related methods here.*/
 };
@@ -0,0 +1,170 @@
+// Per-thread log rings and the thread that drains them.
+
+#include "ylog.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define YLOG_SLOTS    512   // messages per thread ring
+#define YLOG_MSG      240   // longer messages are cut
+#define YLOG_FLUSH_US 10000 // how often the rings are drained
+
+// Single producer (the owning thread), single consumer (whoever holds
+// drain_mutex). head and tail only ever grow; the producer owns head,
+// the consumer owns tail, each reads the other's with acquire.
+struct ylog_ring {
+  unsigned int head;
+  unsigned int tail;
+  unsigned int dropped;  // messages lost because the ring was full
+  int in_use;            // owned by a live thread
+  struct ylog_ring *next;
+  struct {
+    unsigned short len;
+    char msg[YLOG_MSG];
+  } slot[YLOG_SLOTS];
+};
+
+// Rings are never freed. When its thread exits a ring is handed to the
+// next new thread, which drains what is left in it first, so there are
+// only as many rings as threads ever alive at once.
+static struct ylog_ring *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;  // its destructor releases the ring
+static __thread struct ylog_ring *my_ring;
+
+static void *
+flusher(void *)
+{
+  while (1) {
+    usleep(YLOG_FLUSH_US);
+    ylog_flush();
+  }
+  return NULL;
+}
+
+static void
+release_ring(void *arg)
+{
+  struct ylog_ring *r = (struct ylog_ring *)arg;
+  my_ring = NULL;
+  __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+start_flusher()
+{
+  pthread_key_create(&ring_key, release_ring);
+  pthread_t th;
+  if (pthread_create(&th, NULL, flusher, NULL) == 0)
+    pthread_detach(th);
+  atexit(ylog_flush);
+}
+
+static struct ylog_ring *
+new_ring()
+{
+  pthread_once(&flusher_once, start_flusher);
+
+  pthread_mutex_lock(&rings_mutex);
+  struct ylog_ring *r = rings;
+  for (; r != NULL; r = r->next) {
+    if (!__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE))
+      break;
+  }
+  if (r == NULL) {
+    r = (struct ylog_ring *)calloc(1, sizeof(*r));
+    if (r == NULL) {
+      pthread_mutex_unlock(&rings_mutex);
+      return NULL;
+    }
+    r->next = rings;
+    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+  }
+  r->in_use = 1;
+  pthread_mutex_unlock(&rings_mutex);
+  pthread_setspecific(ring_key, r);
+
+  // start with the whole ring; this thread is the producer from now on
+  if (r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+    ylog_flush();
+  return r;
+}
+
+void
+ylog_printf(const char *fmt, ...)
+{
+  struct ylog_ring *r = my_ring;
+  if (r == NULL && (r = my_ring = new_ring()) == NULL)
+    return;
+
+  unsigned int h = r->head;
+  if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == YLOG_SLOTS) {
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(r->slot[h % YLOG_SLOTS].msg, YLOG_MSG, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    n = 0;
+  if (n >= YLOG_MSG) {
+    n = YLOG_MSG - 1;
+    r->slot[h % YLOG_SLOTS].msg[n - 1] = '\n';
+  }
+  r->slot[h % YLOG_SLOTS].len = n;
+  __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static void
+write_all(const char *buf, size_t n)
+{
+  while (n > 0) {
+    ssize_t w = write(1, buf, n);
+    if (w <= 0)
+      return;
+    buf += w;
+    n -= w;
+  }
+}
+
+void
+ylog_flush()
+{
+  static char out[YLOG_SLOTS * YLOG_MSG];
+  size_t n = 0;
+
+  pthread_mutex_lock(&drain_mutex);
+  struct ylog_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  for (; r != NULL; r = r->next) {
+    unsigned int h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int t = r->tail;
+    for (; t != h; t++) {
+      unsigned int len = r->slot[t % YLOG_SLOTS].len;
+      if (n + len > sizeof(out)) {
+        write_all(out, n);
+        n = 0;
+      }
+      memcpy(out + n, r->slot[t % YLOG_SLOTS].msg, len);
+      n += len;
+    }
+    __atomic_store_n(&r->tail, h, __ATOMIC_RELEASE);
+
+    unsigned int lost = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+      if (n + 64 > sizeof(out)) {
+        write_all(out, n);
+        n = 0;
+      }
+      n += snprintf(out + n, 64, "ylog: %u messages dropped\n", lost);
+    }
+  }
+  write_all(out, n);
+  pthread_mutex_unlock(&drain_mutex);
+}
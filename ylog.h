@@ -0,0 +1,30 @@
+#ifndef ylog_h
+#define ylog_h
+
+// Leveled logging for the yfs client and the extent server.
+//
+// Levels are the jsl_log ones (JSL_DBG_1 critical ... JSL_DBG_4 debugging).
+// A call above YFS_LOG_LEVEL is compiled out, arguments included.
+// The others are formatted into a per-thread ring buffer without taking
+// any lock, and a background thread writes the rings to stdout.
+// Whatever is still buffered is written out at exit().
+
+#include "jsl_log.h"
+
+#ifndef YFS_LOG_LEVEL
+#define YFS_LOG_LEVEL JSL_DBG_3
+#endif
+
+#define ylog(level, ...)                                      \
+  do {                                                        \
+    if ((level) <= YFS_LOG_LEVEL)                             \
+      ylog_printf(__VA_ARGS__);                               \
+  } while (0)
+
+void ylog_printf(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2)));
+
+// Write out everything logged so far.
+void ylog_flush();
+
+#endif